@@ -11,10 +11,53 @@
 #define STATUS_DOWNLOAD_STOPPED       6
 #define STATUS_FILE_CREATE_FAILURE    7
 #define STATUS_MD5_CHANGED            8
+#define STATUS_NO_DISK_SPACE          9
 
 // File part size (100 MB)
 #define PART_SIZE (100 * 1024 * 1024)
 
+// Part size of manifest ("part-size:" line of .md5 file) must be a multiple 
+// of it (64 KB), so reads of parts stay aligned for unbuffered I/O
+#define MIN_PART_SIZE (64 * 1024)
+
+// Verification failures repaired by downloading the corrupted parts again
+// before the file is reported as corrupted
+#define MAX_REPAIR_COUNT 3
+
+// Segment is not split by idle connections if less than 2 * MIN_SPLIT_SIZE
+// bytes of it remain (1 MB)
+#define MIN_SPLIT_SIZE (1024 * 1024)
+
+// Default size of write-behind buffer of a segment (1 MB)
+#define DEFAULT_WRITE_BUFFER_SIZE (1024 * 1024)
+
+// Buffers owned by disk writer: buffers being filled by segments and 
+// queued for writing. Transfers are paused when all of them are in use.
+#define DISK_WRITER_BUFFERS 32
+
+// Output file backends: positional WriteFile (through disk writer, if it is 
+// started), or copying to views of file mapping
+#define WRITE_MODE_FILE   0
+#define WRITE_MODE_MAPPED 1
+#define WRITE_MODE_DIRECT 2 // Bypass system cache (FILE_FLAG_NO_BUFFERING)
+
+// Offsets, sizes and buffers of unbuffered I/O are aligned to this size.
+// Covers sectors of 4K disks and matches the page size.
+#define DIRECT_IO_ALIGNMENT 4096
+
+// Default global connection budget shared by concurrently downloaded files
+#define DEFAULT_MAX_CONNECTIONS 16
+
+// Metadata (.md5 files, file sizes) of URL list is fetched with not more
+// than this number of concurrent requests
+#define MAX_METADATA_REQUESTS 16
+
+// Connection count auto tuning: initial connection count, minimal throughput 
+// gain (percent) to keep added connections, periods between probes
+#define AUTO_INITIAL_CONNECTIONS 4
+#define AUTO_MIN_GAIN            5
+#define AUTO_HOLD_PERIODS        5
+
 // Unpack results
 #define UNPACK_SUCCESS      0
 #define UNPACK_NOT_ARCHIVE  1
@@ -0,0 +1,106 @@
+#include <windows.h>
+#include <tchar.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "curl/curl.h"
+#include "common/types.h"
+#include "common/httppool.h"
+#include "common/misc.h"
+#include "common/logging.h"
+
+using namespace std;
+
+// Maximum number of idle handles kept for a host
+#define MAX_IDLE_HANDLES_PER_HOST 32
+
+typedef multimap<string, CURL *> HttpHandleMap;
+
+static lock_t pool_lock;
+static HttpHandleMap idle_handles; // pool_lock MUST be held when accessing this map
+static bool pool_initialized = false;
+static CURLSH *http_share = NULL;  // pool_lock MUST be held when accessing this member
+
+void InitHttpPool()
+{
+	InitLock(&pool_lock);
+	pool_initialized = true;
+}
+
+void CleanupHttpPool()
+{
+	if (!pool_initialized)
+		return;
+	Lock(&pool_lock);
+	for (HttpHandleMap::iterator iter = idle_handles.begin(); iter != idle_handles.end(); iter++)
+		curl_easy_cleanup(iter->second);
+	idle_handles.clear();
+	Unlock(&pool_lock);
+	CloseLock(&pool_lock);
+	pool_initialized = false;
+}
+
+void SetHttpShare(CURLSH *share)
+{
+	if (!pool_initialized)
+		return;
+	Lock(&pool_lock);
+	http_share = share;
+	if (!share)
+	{
+		for (HttpHandleMap::iterator iter = idle_handles.begin(); iter != idle_handles.end(); iter++)
+			curl_easy_setopt(iter->second, CURLOPT_SHARE, NULL);
+	}
+	Unlock(&pool_lock);
+}
+
+CURL *AcquireHttpHandle(const std::string& url)
+{
+	CURL *http_handle = NULL;
+	CURLSH *share = NULL;
+	if (pool_initialized)
+	{
+		Lock(&pool_lock);
+		HttpHandleMap::iterator iter = idle_handles.find(GetHostKey(url));
+		if (iter != idle_handles.end())
+		{
+			http_handle = iter->second;
+			idle_handles.erase(iter);
+		}
+		share = http_share;
+		Unlock(&pool_lock);
+	}
+	if (!http_handle)
+		http_handle = curl_easy_init();
+	if (http_handle && share)
+	{
+		// Options are reset on release, so the share is attached every time
+		curl_easy_setopt(http_handle, CURLOPT_SHARE, share);
+		curl_easy_setopt(http_handle, CURLOPT_COOKIEFILE, "");
+	}
+	return http_handle;
+}
+
+void ReleaseHttpHandle(const std::string& url, CURL *http_handle)
+{
+	if (!http_handle)
+		return;
+
+	// Reset options but keep live connections, DNS cache and session IDs
+	curl_easy_reset(http_handle);
+
+	if (pool_initialized)
+	{
+		string key = GetHostKey(url);
+		Lock(&pool_lock);
+		if (idle_handles.count(key) < MAX_IDLE_HANDLES_PER_HOST)
+		{
+			idle_handles.insert(make_pair(key, http_handle));
+			http_handle = NULL;
+		}
+		Unlock(&pool_lock);
+	}
+
+	if (http_handle)
+		curl_easy_cleanup(http_handle);
+}
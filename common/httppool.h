@@ -0,0 +1,35 @@
+#ifndef _HTTPPOOL_H_
+#define _HTTPPOOL_H_
+
+#include "common/types.h"
+#include "curl/curl.h"
+
+/**
+ *	Pool of cURL handles keyed by host. Released handles keep their
+ *	connections alive, so the next request to the same host does not pay
+ *	for TCP/TLS handshake again.
+ *	NOTE: InitHttpPool() must be called after curl_global_init().
+ */
+void InitHttpPool();
+
+void CleanupHttpPool();
+
+/**
+ *	Attach handles to cURL share (DNS, SSL sessions, cookies). Cookie engine
+ *	is enabled for attached handles. NULL detaches idle handles; handles
+ *	in use must be released before the share is destroyed.
+ */
+void SetHttpShare(CURLSH *share);
+
+/**
+ *	Get warm cURL handle for the URL's host, or a new one if there is none.
+ *	@return NULL if handle could not be created
+ */
+CURL *AcquireHttpHandle(const std::string& url);
+
+/**
+ *	Return handle to pool. All options are reset; connections stay open.
+ */
+void ReleaseHttpHandle(const std::string& url, CURL *http_handle);
+
+#endif
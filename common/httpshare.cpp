@@ -0,0 +1,49 @@
+#include <windows.h>
+#include <tchar.h>
+#include <string>
+#include "curl/curl.h"
+#include "common/types.h"
+#include "common/httpshare.h"
+#include "common/logging.h"
+
+using namespace std;
+
+HttpShare::HttpShare()
+{
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		InitLock(&locks_[i]);
+
+	share_handle_ = curl_share_init();
+	if (!share_handle_)
+		return;
+
+	curl_share_setopt(share_handle_, CURLSHOPT_LOCKFUNC, LockCallback);
+	curl_share_setopt(share_handle_, CURLSHOPT_UNLOCKFUNC, UnlockCallback);
+	curl_share_setopt(share_handle_, CURLSHOPT_USERDATA, this);
+	curl_share_setopt(share_handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share_handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+	// Older cURL versions do not share SSL session IDs; not fatal
+	if (CURLSHE_OK != curl_share_setopt(share_handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION))
+		LOG(("[HttpShare] SSL session IDs are not shared\n"));
+}
+
+HttpShare::~HttpShare()
+{
+	if (share_handle_)
+		curl_share_cleanup(share_handle_);
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		CloseLock(&locks_[i]);
+}
+
+void HttpShare::LockCallback(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	// Shared and exclusive access are not distinguished
+	HttpShare *share = (HttpShare*)userptr;
+	Lock(&share->locks_[data]);
+}
+
+void HttpShare::UnlockCallback(CURL *handle, curl_lock_data data, void *userptr)
+{
+	HttpShare *share = (HttpShare*)userptr;
+	Unlock(&share->locks_[data]);
+}
@@ -0,0 +1,35 @@
+#ifndef _HTTPSHARE_H_
+#define _HTTPSHARE_H_
+
+#include "common/types.h"
+#include "curl/curl.h"
+
+/**
+ *	cURL share of DNS cache, SSL session IDs and cookies. Handles attached
+ *	to it do not resolve hosts and negotiate TLS sessions from scratch.
+ *	Handles are used from several threads, so shared data are protected 
+ *	by locks (one per data type).
+ *	NOTE: all handles must be detached before the share is destroyed.
+ */
+class HttpShare
+{
+public:
+	HttpShare();
+
+	virtual ~HttpShare();
+
+	/**
+	 *	@return NULL if share could not be created
+	 */
+	CURLSH *GetHandle() { return share_handle_; }
+
+private:
+	CURLSH *share_handle_;
+	lock_t locks_[CURL_LOCK_DATA_LAST];
+
+	// CURL callbacks
+	static void LockCallback(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+	static void UnlockCallback(CURL *handle, curl_lock_data data, void *userptr);
+};
+
+#endif
@@ -6,6 +6,8 @@
 using namespace std;
 
 #include "common/types.h"
+#include "common/httppool.h"
+#include "common/redirectcache.h"
 #include "engine/downloader.h"
 
 int WINAPI WinMain(      
@@ -16,15 +18,22 @@ int WINAPI WinMain(
 )
 {
 	curl_global_init(CURL_GLOBAL_ALL);
+	InitHttpPool();
+	InitRedirectCache();
 
 	UrlList url_list;
 //	url_list.push_back("http://sandbox.ivan4ik.ru/downloader/porn.dat");
 	url_list.push_back("http://ivan4ik.ru/downloader/01/package.zip");
 
-	Downloader d(url_list, 1000000000ULL);
+	{
+		// Downloader owns cURL handles; destroy it before cURL cleanup
+		Downloader d(url_list, 1000000000ULL);
 
-	d.Run();
+		d.Run();
+	}
 
+	CleanupRedirectCache();
+	CleanupHttpPool();
 	curl_global_cleanup();
 
 	return 0;
@@ -7,6 +7,8 @@
 #include "curl/curl.h"
 #include "common/types.h"
 #include "common/misc.h"
+#include "common/httppool.h"
+#include "common/redirectcache.h"
 
 using namespace std;
 
@@ -34,6 +36,19 @@ static size_t FileSizeWriteData(void *buffer, size_t size, size_t nmemb, void *u
 	return nmemb;
 }
 
+/**
+ *	Cache target of the redirect chain if the request has succeeded, 
+ *	or make the next request follow the chain again if cached target has failed.
+ */
+static void UpdateRedirectTarget(const std::string& url, const std::string& request_url, 
+								 CURL *http_handle, CURLcode result)
+{
+	if (CURLE_OK == result)
+		StoreRedirectTarget(url, http_handle);
+	else if (request_url != url)
+		ForgetRedirectTarget(url);
+}
+
 /**
  *	Get HTTP file size using cURL. 
  *	NOTE: curl_global_init() must be issued prior calling this routine.
@@ -43,12 +58,13 @@ bool HttpGetFileSize(const std::string& url, __out unsigned long long& file_size
 	size_t size = -1;
 	bool ret_val = false;
 
-	CURL *http_handle = curl_easy_init();
+	string request_url = ResolveUrl(url);
+	CURL *http_handle = AcquireHttpHandle(request_url);
 
 	if (!http_handle)
 		return false;
 
-	curl_easy_setopt(http_handle, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(http_handle, CURLOPT_URL, request_url.c_str());
 	curl_easy_setopt(http_handle, CURLOPT_HEADER, 1);
 	curl_easy_setopt(http_handle, CURLOPT_NOBODY, 1);
 	curl_easy_setopt(http_handle, CURLOPT_MAXREDIRS, 500);
@@ -61,13 +77,15 @@ bool HttpGetFileSize(const std::string& url, __out unsigned long long& file_size
 	curl_easy_setopt(http_handle, CURLOPT_WRITEHEADER, &size);
 	SetProxyForHttpHandle(http_handle);
 
-	if (0 == curl_easy_perform(http_handle) && -1 != size)
+	CURLcode result = curl_easy_perform(http_handle);
+	UpdateRedirectTarget(url, request_url, http_handle, result);
+	if (0 == result && -1 != size)
 	{
 		file_size = size;
 		ret_val = true;
 	}
 
-	curl_easy_cleanup(http_handle);
+	ReleaseHttpHandle(request_url, http_handle);
 
 	return ret_val;
 }
@@ -119,12 +137,13 @@ bool HttpReadFileToBuffer(const std::string& url, void *buf, size_t size, __out
 	rd.size_ = size;
 	rd.position_ = 0;
 
-	CURL *http_handle = curl_easy_init();
+	string request_url = ResolveUrl(url);
+	CURL *http_handle = AcquireHttpHandle(request_url);
 
 	if (!http_handle)
 		return false;
 
-	curl_easy_setopt(http_handle, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(http_handle, CURLOPT_URL, request_url.c_str());
 	curl_easy_setopt(http_handle, CURLOPT_MAXREDIRS, 500);
 	curl_easy_setopt(http_handle, CURLOPT_FOLLOWLOCATION, 1);
 
@@ -132,12 +151,14 @@ bool HttpReadFileToBuffer(const std::string& url, void *buf, size_t size, __out
 	curl_easy_setopt(http_handle, CURLOPT_WRITEDATA, &rd);
 	SetProxyForHttpHandle(http_handle);
 
-	ret_val = (0 == curl_easy_perform(http_handle));
+	CURLcode result = curl_easy_perform(http_handle);
+	UpdateRedirectTarget(url, request_url, http_handle, result);
+	ret_val = (0 == result);
 
 	if (ret_val)
 		read_size = rd.position_;
 
-	curl_easy_cleanup(http_handle);
+	ReleaseHttpHandle(request_url, http_handle);
 
 	return ret_val;
 }
@@ -174,12 +195,13 @@ bool HttpReadFileDynamic(const std::string& url, std::vector<BYTE>& buf)
 	rd.position_ = 0;
 	rd.buf_.resize(1);
 
-	CURL *http_handle = curl_easy_init();
+	string request_url = ResolveUrl(url);
+	CURL *http_handle = AcquireHttpHandle(request_url);
 
 	if (!http_handle)
 		return false;
 
-	curl_easy_setopt(http_handle, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(http_handle, CURLOPT_URL, request_url.c_str());
 	curl_easy_setopt(http_handle, CURLOPT_MAXREDIRS, 500);
 	curl_easy_setopt(http_handle, CURLOPT_FOLLOWLOCATION, 1);
 
@@ -187,7 +209,9 @@ bool HttpReadFileDynamic(const std::string& url, std::vector<BYTE>& buf)
 	curl_easy_setopt(http_handle, CURLOPT_WRITEDATA, &rd);
 	SetProxyForHttpHandle(http_handle);
 
-	ret_val = (0 == curl_easy_perform(http_handle));
+	CURLcode result = curl_easy_perform(http_handle);
+	UpdateRedirectTarget(url, request_url, http_handle, result);
+	ret_val = (0 == result);
 
 	if (ret_val)
 	{
@@ -195,7 +219,7 @@ bool HttpReadFileDynamic(const std::string& url, std::vector<BYTE>& buf)
 		memcpy(&buf[0], &rd.buf_[0], rd.position_);
 	}
 
-	curl_easy_cleanup(http_handle);
+	ReleaseHttpHandle(request_url, http_handle);
 
 	return ret_val;
 }
@@ -264,8 +288,23 @@ bool SetProxyForHttpHandle(void *http_handle)
 	return true;
 }
 
-HANDLE OpenOrCreate(const StlString& fname, DWORD access)
+std::string GetHostKey(const std::string& url)
+{
+	size_t host_pos = url.find("://");
+	host_pos = (string::npos == host_pos) ? 0 : host_pos + 3;
+	size_t path_pos = url.find_first_of("/?#", host_pos);
+	string key = url.substr(0, path_pos);
+	// Strip user credentials, if any
+	size_t at_pos = key.find('@', host_pos);
+	if (string::npos != at_pos)
+		key.erase(host_pos, at_pos + 1 - host_pos);
+	for (size_t i = 0; i < key.size(); i++)
+		key[i] = (char)tolower((unsigned char)key[i]);
+	return key;
+}
+
+HANDLE OpenOrCreate(const StlString& fname, DWORD access, DWORD share, DWORD flags)
 {
 	return CreateFile(fname.c_str(), access, 
-		FILE_SHARE_READ, NULL, OPEN_ALWAYS, 0, NULL);
+		share, NULL, OPEN_ALWAYS, flags, NULL);
 }
@@ -13,6 +13,12 @@ bool HttpReadFileDynamic(const std::string& url, std::vector<BYTE>& buf);
 
 bool SetProxyForHttpHandle(void *http_handle);
 
-HANDLE OpenOrCreate(const StlString& fname, DWORD access);
+/**
+ *	Get host key ("scheme://host:port") from URL.
+ */
+std::string GetHostKey(const std::string& url);
+
+HANDLE OpenOrCreate(const StlString& fname, DWORD access, 
+					DWORD share = FILE_SHARE_READ, DWORD flags = 0);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include <windows.h>
+#include <tchar.h>
+#include <string>
+#include <map>
+#include "curl/curl.h"
+#include "common/types.h"
+#include "common/redirectcache.h"
+#include "common/logging.h"
+
+using namespace std;
+
+// Redirect target is followed again after this period: CDN-s issue 
+// signed URL-s which expire, msec
+#define REDIRECT_CACHE_TTL (10 * 60 * 1000)
+
+struct RedirectTarget {
+	string url_;
+	DWORD store_tick_;
+};
+
+typedef map<string, RedirectTarget> RedirectMap;
+
+static lock_t cache_lock;
+static RedirectMap targets; // cache_lock MUST be held when accessing this map
+static bool cache_initialized = false;
+
+void InitRedirectCache()
+{
+	InitLock(&cache_lock);
+	cache_initialized = true;
+}
+
+void CleanupRedirectCache()
+{
+	if (!cache_initialized)
+		return;
+	Lock(&cache_lock);
+	targets.clear();
+	Unlock(&cache_lock);
+	CloseLock(&cache_lock);
+	cache_initialized = false;
+}
+
+std::string ResolveUrl(const std::string& url)
+{
+	if (!cache_initialized)
+		return url;
+
+	string target = url;
+	Lock(&cache_lock);
+	RedirectMap::iterator iter = targets.find(url);
+	if (iter != targets.end())
+	{
+		if (GetTickCount() - iter->second.store_tick_ < REDIRECT_CACHE_TTL)
+			target = iter->second.url_;
+		else
+			targets.erase(iter);
+	}
+	Unlock(&cache_lock);
+	return target;
+}
+
+void StoreRedirectTarget(const std::string& url, CURL *http_handle)
+{
+	char *effective_url = NULL;
+	if (!cache_initialized 
+		|| CURLE_OK != curl_easy_getinfo(http_handle, CURLINFO_EFFECTIVE_URL, &effective_url)
+		|| !effective_url)
+		return;
+
+	Lock(&cache_lock);
+	RedirectMap::iterator iter = targets.find(url);
+	if (url == effective_url)
+	{
+		if (iter != targets.end())
+			targets.erase(iter);
+	}
+	else if (iter == targets.end() || iter->second.url_ != effective_url)
+	{
+		// Expiration time is counted from the moment the chain was followed
+		LOG(("[StoreRedirectTarget] %s -> %s\n", url.c_str(), effective_url));
+		RedirectTarget target;
+		target.url_ = effective_url;
+		target.store_tick_ = GetTickCount();
+		targets[url] = target;
+	}
+	Unlock(&cache_lock);
+}
+
+void ForgetRedirectTarget(const std::string& url)
+{
+	if (!cache_initialized)
+		return;
+	Lock(&cache_lock);
+	targets.erase(url);
+	Unlock(&cache_lock);
+}
@@ -0,0 +1,33 @@
+#ifndef _REDIRECTCACHE_H_
+#define _REDIRECTCACHE_H_
+
+#include "common/types.h"
+#include "curl/curl.h"
+
+/**
+ *	Final URL-s of redirect chains. A chain is followed once; following 
+ *	requests for the URL go to its target directly until the target 
+ *	expires or a request to it fails.
+ *	NOTE: InitRedirectCache() must be called before any HTTP request.
+ */
+void InitRedirectCache();
+
+void CleanupRedirectCache();
+
+/**
+ *	Get URL the request should be sent to: cached target of url, or url itself.
+ */
+std::string ResolveUrl(const std::string& url);
+
+/**
+ *	Remember the URL request for url has been redirected to.
+ *	Effective URL is taken from the handle which has received response.
+ */
+void StoreRedirectTarget(const std::string& url, CURL *http_handle);
+
+/**
+ *	Forget target of url, so the chain is followed again by the next request.
+ */
+void ForgetRedirectTarget(const std::string& url);
+
+#endif
@@ -3,6 +3,11 @@
 
 #include <string>
 #include <windows.h>
+#include <intrin.h>
+
+// Compiles to cmpxchg8b; InterlockedCompareExchange64 is not exported by 
+// kernel32 of Windows XP
+#pragma intrinsic(_InterlockedCompareExchange64)
 
 #ifdef UNICODE
 typedef std::wstring StlString;
@@ -16,5 +21,34 @@ typedef CRITICAL_SECTION lock_t;
 #define InitLock(lk) InitializeCriticalSection(lk)
 #define CloseLock(lk) DeleteCriticalSection(lk)
 
+/**
+ *	64-bit counters which are updated by one thread and read by others.
+ *	Plain access is not atomic on 32-bit x86.
+ */
+inline unsigned long long AtomicRead64(const volatile unsigned long long *value)
+{
+	return (unsigned long long)_InterlockedCompareExchange64((volatile __int64*)value, 0, 0);
+}
+
+inline unsigned long long AtomicAdd64(volatile unsigned long long *value, unsigned long long addend)
+{
+	__int64 old_value;
+	do
+		old_value = (__int64)AtomicRead64(value);
+	while (old_value != _InterlockedCompareExchange64((volatile __int64*)value, 
+													old_value + (__int64)addend, old_value));
+	return (unsigned long long)old_value + addend;
+}
+
+inline unsigned long long AtomicExchange64(volatile unsigned long long *value, unsigned long long new_value)
+{
+	__int64 old_value;
+	do
+		old_value = (__int64)AtomicRead64(value);
+	while (old_value != _InterlockedCompareExchange64((volatile __int64*)value, 
+													(__int64)new_value, old_value));
+	return (unsigned long long)old_value;
+}
+
 #endif
 
@@ -0,0 +1,112 @@
+#include <windows.h>
+#include <tchar.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "engine/digest.h"
+#include "engine/sha256.h"
+
+class Md5Digest : public Digest
+{
+public:
+	unsigned int GetType() const { return DIGEST_MD5; }
+	void Reset() { md5_.reset(); }
+	void Append(const void *data, int size) { md5_.append(data, size); }
+	string Finish() { md5_.finish(); return md5_.getFingerprint(); }
+	string GetState() const { return md5_.getState(); }
+	bool SetState(const string& state) { return md5_.setState(state); }
+
+	MD5 md5_;
+};
+
+class Sha256Digest : public Digest
+{
+public:
+	Sha256Digest(unsigned int type) : type_(type) {}
+	unsigned int GetType() const { return type_; }
+	void Reset() { sha_.reset(); }
+	void Append(const void *data, int size) { sha_.append(data, size); }
+	string Finish() { sha_.finish(); return sha_.getFingerprint(); }
+	string GetState() const { return sha_.getState(); }
+	bool SetState(const string& state) { return sha_.setState(state); }
+
+private:
+	unsigned int type_;
+	SHA256 sha_;
+};
+
+Digest *Digest::Create(unsigned int type)
+{
+	switch (type)
+	{
+	case DIGEST_MD5:
+		return new Md5Digest();
+	case DIGEST_SHA256:
+	case DIGEST_SHA256_TREE:
+		return new Sha256Digest(type);
+	}
+	return NULL;
+}
+
+bool Digest::ParseType(const std::string& name, __out unsigned int& type)
+{
+	if (0 == _stricmp(name.c_str(), "md5"))
+		type = DIGEST_MD5;
+	else if (0 == _stricmp(name.c_str(), "sha256"))
+		type = DIGEST_SHA256;
+	else if (0 == _stricmp(name.c_str(), "sha256-tree"))
+		type = DIGEST_SHA256_TREE;
+	else
+		return false;
+	return true;
+}
+
+size_t Digest::GetHexLength(unsigned int type)
+{
+	return DIGEST_MD5 == type ? 0x20 : 0x40;
+}
+
+bool Digest::IsTree(unsigned int type)
+{
+	return DIGEST_SHA256_TREE == type;
+}
+
+std::string Digest::GetTreeRoot(unsigned int type, const std::vector<std::string>& part_digests)
+{
+	// Root is computed over binary digests, so it does not depend on hex case
+	SHA256 root;
+	for (size_t i = 0; i < part_digests.size(); i++)
+	{
+		const string& hex = part_digests[i];
+		for (size_t j = 0; j + 1 < hex.size(); j += 2)
+		{
+			unsigned int value;
+			sscanf(hex.c_str() + j, "%2X", &value);
+			BYTE byte = (BYTE)value;
+			root.append(&byte, 1);
+		}
+	}
+	root.finish();
+	return root.getFingerprint();
+}
+
+void Digest::AppendMulti(Digest *digests[], const void *data[], const int sizes[], int count)
+{
+	bool md5 = true;
+	for (int i = 0; i < count; i++)
+		md5 = md5 && DIGEST_MD5 == digests[i]->GetType();
+
+	if (md5)
+	{
+		MD5 *lanes[DIGEST_LANES];
+		for (int i = 0; i < count; i++)
+			lanes[i] = &((Md5Digest*)digests[i])->md5_;
+		MD5::appendMulti(lanes, data, sizes, count);
+		return;
+	}
+	for (int i = 0; i < count; i++)
+		digests[i]->Append(data[i], sizes[i]);
+}
@@ -0,0 +1,75 @@
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include "common/types.h"
+#include <vector>
+#include "engine/md5.h"
+
+// Digest algorithms of manifest ("digest:" line of .md5 file)
+#define DIGEST_MD5          0 // Default: digests of parts and of the whole file
+#define DIGEST_SHA256       1
+#define DIGEST_SHA256_TREE  2 // File digest is SHA-256 over binary part digests
+
+// Max number of messages hashed at once by Digest::AppendMulti()
+#define DIGEST_LANES MD5_LANES
+
+/**
+ *	Hash algorithm used to verify downloaded files. Digests are represented
+ *	as upper-case hex strings, like in .md5 file.
+ */
+class Digest
+{
+public:
+	virtual ~Digest() {}
+
+	static Digest *Create(unsigned int type);
+
+	/**
+	 *	@param name	Algorithm name of manifest: md5, sha256, sha256-tree
+	 *	@return false if algorithm is unknown
+	 */
+	static bool ParseType(const std::string& name, __out unsigned int& type);
+
+	/**
+	 *	@return Length of digest in hex characters
+	 */
+	static size_t GetHexLength(unsigned int type);
+
+	/**
+	 *	Tree digests of whole file are computed from part digests instead 
+	 *	of file data, so parts may be hashed independently.
+	 */
+	static bool IsTree(unsigned int type);
+
+	/**
+	 *	@return Whole-file digest of tree type computed from part digests
+	 */
+	static std::string GetTreeRoot(unsigned int type, const std::vector<std::string>& part_digests);
+
+	/**
+	 *	Append data[i] to digests[i] for count (up to DIGEST_LANES) messages
+	 *	of the same type. MD5 messages are hashed in parallel lanes.
+	 */
+	static void AppendMulti(Digest *digests[], const void *data[], const int sizes[], int count);
+
+	virtual unsigned int GetType() const = 0;
+
+	virtual void Reset() = 0;
+
+	virtual void Append(const void *data, int size) = 0;
+
+	/**
+	 *	Finish the message.
+	 *	@return Hex digest
+	 */
+	virtual std::string Finish() = 0;
+
+	/**
+	 *	Intermediate state, to resume hashing later
+	 */
+	virtual std::string GetState() const = 0;
+
+	virtual bool SetState(const std::string& state) = 0;
+};
+
+#endif
@@ -0,0 +1,310 @@
+#include <windows.h>
+#include <tchar.h>
+#include <process.h>
+#include <string.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#include "engine/digestverifier.h"
+#include "common/consts.h"
+#include "common/misc.h"
+#include "common/logging.h"
+
+// Files are read by this size. Offsets of unbuffered reads stay aligned, 
+// since parts start at multiples of MIN_PART_SIZE.
+#define VERIFY_BUFFER_SIZE (1024 * 1024)
+
+DigestVerifier::DigestVerifier(const StlString& file_name, unsigned int digest_type, 
+							   unsigned long long part_size, 
+							   const std::list<std::string>& digest_list, bool unbuffered)
+: file_name_(file_name), digest_type_(digest_type), part_size_(part_size), 
+  digest_list_(digest_list), unbuffered_(unbuffered)
+{
+	file_handle_ = INVALID_HANDLE_VALUE;
+	file_size_ = 0;
+	part_count_ = 0;
+	next_part_ = 0;
+	group_size_ = 1;
+	read_failed_ = 0;
+}
+
+DigestVerifier::~DigestVerifier()
+{
+	if (INVALID_HANDLE_VALUE != file_handle_)
+		CloseHandle(file_handle_);
+}
+
+bool DigestVerifier::Verify(unsigned int thread_count)
+{
+	failed_parts_.clear();
+	if (!OpenFile())
+		return false;
+
+	parts_.resize(part_count_);
+	for (size_t i = 0; i < part_count_; i++)
+		parts_[i] = i;
+	bool tree = Digest::IsTree(digest_type_);
+	if (!Hash(thread_count, !tree))
+		return false;
+	if (tree)
+		file_digest_ = Digest::GetTreeRoot(digest_type_, part_digests_);
+	return Compare(digest_list_, part_digests_, file_digest_, failed_parts_);
+}
+
+bool DigestVerifier::VerifyParts(const std::vector<size_t>& parts, unsigned int thread_count)
+{
+	failed_parts_.clear();
+	if (!OpenFile())
+		return false;
+
+	parts_.clear();
+	for (size_t i = 0; i < parts.size(); i++)
+	{
+		if (parts[i] >= part_count_ || parts[i] >= digest_list_.size())
+			return false;
+		parts_.push_back(parts[i]);
+	}
+	// Parts of a worker group are hashed while the first one has data
+	sort(parts_.begin(), parts_.end());
+	if (!Hash(thread_count, false))
+		return false;
+
+	vector<string> digests(digest_list_.begin(), digest_list_.end());
+	for (size_t i = 0; i < parts_.size(); i++)
+	{
+		if (digests[parts_[i]] != part_digests_[parts_[i]])
+		{
+			LOG(("[DigestVerifier::VerifyParts] Part %u is corrupted\n", (unsigned int)parts_[i]));
+			failed_parts_.push_back(parts_[i]);
+		}
+	}
+	return failed_parts_.empty();
+}
+
+bool DigestVerifier::OpenFile()
+{
+	file_handle_ = OpenOrCreate(file_name_, GENERIC_READ, FILE_SHARE_READ, 
+		unbuffered_ ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN);
+	LARGE_INTEGER size;
+	if (INVALID_HANDLE_VALUE == file_handle_ || !GetFileSizeEx(file_handle_, &size) || 0 == part_size_)
+	{
+		LOG(("[DigestVerifier::OpenFile] ERROR: Could not open file: %S\n", 
+			std::wstring(file_name_.begin(), file_name_.end()).c_str()));
+		if (INVALID_HANDLE_VALUE != file_handle_)
+		{
+			CloseHandle(file_handle_);
+			file_handle_ = INVALID_HANDLE_VALUE;
+		}
+		return false;
+	}
+	file_size_ = size.QuadPart;
+	part_count_ = (size_t)((file_size_ + part_size_ - 1) / part_size_);
+	part_digests_.assign(part_count_, "");
+	return true;
+}
+
+bool DigestVerifier::Hash(unsigned int thread_count, bool hash_file)
+{
+	next_part_ = 0;
+	read_failed_ = 0;
+
+	if (0 == thread_count)
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		thread_count = info.dwNumberOfProcessors;
+	}
+	thread_count = (unsigned int)min((size_t)thread_count, parts_.size());
+	// All processors are busy first; the rest of parts go to lanes
+	group_size_ = thread_count ? (unsigned int)(parts_.size() / thread_count) : 1;
+	group_size_ = max(1u, min((unsigned int)DIGEST_LANES, group_size_));
+
+	// Work of threads which are not started is done here
+	unsigned thread_id;
+	vector<HANDLE> threads;
+	HANDLE file_thread = NULL;
+	if (hash_file)
+		file_thread = (HANDLE)_beginthreadex(NULL, 0, FileThread, this, 0, &thread_id);
+	for (unsigned int i = 0; i < thread_count; i++)
+	{
+		HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, PartThread, this, 0, &thread_id);
+		if (thread)
+			threads.push_back(thread);
+	}
+	if (threads.empty())
+		HashParts();
+	if (!file_thread && hash_file)
+		HashFile();
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+	if (file_thread)
+	{
+		WaitForSingleObject(file_thread, INFINITE);
+		CloseHandle(file_thread);
+	}
+
+	CloseHandle(file_handle_);
+	file_handle_ = INVALID_HANDLE_VALUE;
+
+	return !read_failed_;
+}
+
+bool DigestVerifier::Compare(const std::list<std::string>& digest_list, 
+							 const std::vector<std::string>& part_digests, 
+							 const std::string& file_digest, 
+							 __out std::vector<size_t>& failed_parts)
+{
+	failed_parts.clear();
+
+	bool ret_val = true;
+	list<string>::const_iterator digest_iter = digest_list.begin();
+	for (size_t i = 0; i < part_digests.size(); i++, digest_iter++)
+	{
+		if (digest_iter == digest_list.end())
+			return false; // Digest list is too short
+		if (*digest_iter != part_digests[i])
+		{
+			LOG(("[DigestVerifier::Compare] Part %u is corrupted\n", (unsigned int)i));
+			failed_parts.push_back(i);
+			ret_val = false;
+		}
+	}
+	if (!part_digests.empty() && digest_iter == digest_list.end())
+		return false; // Whole-file digest is missing
+
+	if (digest_iter != digest_list.end() && *digest_iter != file_digest)
+		ret_val = false;
+	return ret_val;
+}
+
+void DigestVerifier::HashParts()
+{
+	// Synchronous I/O is serialized per handle; every worker opens its own
+	HANDLE file_handle = OpenOrCreate(file_name_, GENERIC_READ, FILE_SHARE_READ, 
+		unbuffered_ ? FILE_FLAG_NO_BUFFERING : 0);
+	BYTE *buffer = (BYTE*)VirtualAlloc(NULL, DIGEST_LANES * VERIFY_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+
+	if (INVALID_HANDLE_VALUE == file_handle || !buffer)
+		InterlockedExchange(&read_failed_, 1);
+
+	while (!read_failed_)
+	{
+		// Parts of a group are taken in ascending order: the first one is the longest
+		size_t parts[DIGEST_LANES];
+		unsigned long long part_sizes[DIGEST_LANES];
+		Digest *part_digest[DIGEST_LANES];
+		unsigned int count;
+		for (count = 0; count < group_size_; count++)
+		{
+			size_t index = (size_t)(InterlockedIncrement(&next_part_) - 1);
+			if (index >= parts_.size())
+				break;
+			parts[count] = parts_[index];
+			part_sizes[count] = min(part_size_, 
+				file_size_ - (unsigned long long)parts[count] * part_size_);
+			part_digest[count] = Digest::Create(digest_type_);
+		}
+		if (0 == count)
+			break;
+
+		for (unsigned long long pos = 0; pos < part_sizes[0] && !read_failed_; pos += VERIFY_BUFFER_SIZE)
+		{
+			Digest *lanes[DIGEST_LANES];
+			const void *data[DIGEST_LANES];
+			int sizes[DIGEST_LANES];
+			int lane_count = 0;
+			for (unsigned int i = 0; i < count; i++)
+			{
+				if (pos >= part_sizes[i])
+					continue;
+				BYTE *lane_buffer = buffer + i * VERIFY_BUFFER_SIZE;
+				size_t size = (size_t)min((unsigned long long)VERIFY_BUFFER_SIZE, part_sizes[i] - pos);
+				if (!ReadChunk(file_handle, lane_buffer, (unsigned long long)parts[i] * part_size_ + pos, size))
+				{
+					InterlockedExchange(&read_failed_, 1);
+					break;
+				}
+				lanes[lane_count] = part_digest[i];
+				data[lane_count] = lane_buffer;
+				sizes[lane_count] = (int)size;
+				lane_count++;
+			}
+			if (!read_failed_)
+				Digest::AppendMulti(lanes, data, sizes, lane_count);
+		}
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!read_failed_)
+				part_digests_[parts[i]] = part_digest[i]->Finish();
+			delete part_digest[i];
+		}
+	}
+
+	if (buffer)
+		VirtualFree(buffer, 0, MEM_RELEASE);
+	if (INVALID_HANDLE_VALUE != file_handle)
+		CloseHandle(file_handle);
+}
+
+void DigestVerifier::HashFile()
+{
+	BYTE *buffer = (BYTE*)VirtualAlloc(NULL, VERIFY_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+	if (!buffer)
+		InterlockedExchange(&read_failed_, 1);
+
+	Digest *file_digest = Digest::Create(digest_type_);
+	for (unsigned long long pos = 0; pos < file_size_ && !read_failed_; pos += VERIFY_BUFFER_SIZE)
+	{
+		size_t size = (size_t)min((unsigned long long)VERIFY_BUFFER_SIZE, file_size_ - pos);
+		if (!ReadChunk(file_handle_, buffer, pos, size))
+			InterlockedExchange(&read_failed_, 1);
+		else
+			file_digest->Append(buffer, (int)size);
+	}
+	file_digest_ = file_digest->Finish();
+	delete file_digest;
+
+	if (buffer)
+		VirtualFree(buffer, 0, MEM_RELEASE);
+}
+
+bool DigestVerifier::ReadChunk(HANDLE file_handle, BYTE *buffer, unsigned long long offset, size_t size)
+{
+	// Positional read of the whole buffer: unbuffered reads are not 
+	// shortened except at the end of file
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	LARGE_INTEGER tmp;
+	tmp.QuadPart = offset;
+	overlapped.Offset = tmp.LowPart;
+	overlapped.OffsetHigh = tmp.HighPart;
+	DWORD nr_read;
+	if (!ReadFile(file_handle, buffer, VERIFY_BUFFER_SIZE, &nr_read, &overlapped) || nr_read < size)
+	{
+		LOG(("[DigestVerifier::ReadChunk] Read failed at 0x%llx, error %u\n", offset, GetLastError()));
+		return false;
+	}
+	return true;
+}
+
+unsigned __stdcall DigestVerifier::PartThread(void *arg)
+{
+	((DigestVerifier*)arg)->HashParts();
+	_endthreadex(0);
+	return 0;
+}
+
+unsigned __stdcall DigestVerifier::FileThread(void *arg)
+{
+	((DigestVerifier*)arg)->HashFile();
+	_endthreadex(0);
+	return 0;
+}
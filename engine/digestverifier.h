@@ -0,0 +1,88 @@
+#ifndef _DIGESTVERIFIER_H_
+#define _DIGESTVERIFIER_H_
+
+#include "common/types.h"
+#include <list>
+#include <vector>
+#include "engine/digest.h"
+
+/**
+ *	Verifies file against digest list of .md5 file: digests of parts 
+ *	followed by the whole-file digest. Parts are hashed concurrently by 
+ *	worker threads with positional reads; every worker takes up to DIGEST_LANES
+ *	parts at once and hashes them in parallel lanes (MD5). The whole-file 
+ *	digest is computed by one more thread which reads the file sequentially,
+ *	unless it is a tree digest, which is computed from part digests.
+ */
+class DigestVerifier
+{
+public:
+	DigestVerifier(const StlString& file_name, unsigned int digest_type, 
+				   unsigned long long part_size, 
+				   const std::list<std::string>& digest_list, bool unbuffered);
+
+	virtual ~DigestVerifier();
+
+	/**
+	 *	@param thread_count  Number of part workers; 0 means the number of processors
+	 *	@return true if the file matches digest list
+	 */
+	bool Verify(unsigned int thread_count);
+
+	/**
+	 *	Verify the listed parts only (e.g. the ones which have been repaired).
+	 *	The whole-file digest is not checked: the rest of parts matched their
+	 *	digests before.
+	 *	@return true if the parts match digest list
+	 */
+	bool VerifyParts(const std::vector<size_t>& parts, unsigned int thread_count);
+
+	/**
+	 *	Parts which do not match their digests after Verify(), VerifyParts()
+	 *	or Compare().
+	 */
+	const std::vector<size_t>& GetFailedParts() { return failed_parts_; }
+
+	/**
+	 *	Compare digests with digest list. Every part must have its digest 
+	 *	in the list, and the whole-file digest follows them.
+	 *	@param failed_parts [out]	Parts which do not match their digests
+	 */
+	static bool Compare(const std::list<std::string>& digest_list, 
+						const std::vector<std::string>& part_digests, 
+						const std::string& file_digest, 
+						__out std::vector<size_t>& failed_parts);
+
+private:
+	StlString file_name_;
+	unsigned int digest_type_;              // DIGEST_XXX
+	unsigned long long part_size_;
+	std::list<std::string> digest_list_;
+	bool unbuffered_;                       // Read bypassing system cache
+	HANDLE file_handle_;                    // Read sequentially for the whole-file digest
+	unsigned long long file_size_;
+	size_t part_count_;
+	std::vector<size_t> parts_;             // Parts to be hashed
+	volatile LONG next_part_;               // Next element of parts_ to be taken by a worker
+	unsigned int group_size_;               // Parts taken by a worker at once
+	volatile LONG read_failed_;
+	std::vector<std::string> part_digests_; // Every element is written by one worker
+	std::string file_digest_;
+	std::vector<size_t> failed_parts_;
+
+	/**
+	 *	Hash parts_ by thread_count workers (0 means the number of 
+	 *	processors), and the whole file if hash_file is set.
+	 *	@return false if the file could not be read
+	 */
+	bool Hash(unsigned int thread_count, bool hash_file);
+	bool OpenFile();
+	void HashParts();
+	void HashFile();
+	bool ReadChunk(HANDLE file_handle, BYTE *buffer, unsigned long long offset, size_t size);
+
+	static unsigned __stdcall PartThread(void *arg);
+	static unsigned __stdcall FileThread(void *arg);
+};
+
+#endif
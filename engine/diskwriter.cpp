@@ -0,0 +1,189 @@
+#include <windows.h>
+#include <tchar.h>
+#include <process.h>
+#include <string.h>
+#include <assert.h>
+#include <string>
+#include <list>
+using namespace std;
+
+#include "engine/diskwriter.h"
+#include "common/logging.h"
+
+DiskWriter::DiskWriter()
+{
+	InitLock(&lock_);
+	thread_handle_ = NULL;
+	queue_event_ = NULL;
+	buffer_size_ = 0;
+	buffer_count_ = 0;
+	allocated_count_ = 0;
+	stopping_ = false;
+}
+
+DiskWriter::~DiskWriter()
+{
+	Stop();
+	for (list<BYTE *>::iterator iter = free_buffers_.begin(); iter != free_buffers_.end(); iter++)
+		VirtualFree(*iter, 0, MEM_RELEASE);
+	CloseLock(&lock_);
+}
+
+bool DiskWriter::Start(size_t buffer_size, unsigned int buffer_count)
+{
+	if (thread_handle_ || 0 == buffer_size || 0 == buffer_count)
+		return false;
+
+	buffer_size_ = buffer_size;
+	buffer_count_ = buffer_count;
+	stopping_ = false;
+	queue_event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!queue_event_)
+		return false;
+
+	unsigned thread_id;
+	thread_handle_ = (HANDLE)_beginthreadex(NULL, 0, WriterThread, this, 0, &thread_id);
+	if (!thread_handle_)
+	{
+		CloseHandle(queue_event_);
+		queue_event_ = NULL;
+		return false;
+	}
+	return true;
+}
+
+void DiskWriter::Stop()
+{
+	if (!thread_handle_)
+		return;
+
+	Lock(&lock_);
+	stopping_ = true;
+	Unlock(&lock_);
+	SetEvent(queue_event_);
+	WaitForSingleObject(thread_handle_, INFINITE);
+	CloseHandle(thread_handle_);
+	thread_handle_ = NULL;
+	CloseHandle(queue_event_);
+	queue_event_ = NULL;
+}
+
+BYTE *DiskWriter::AcquireBuffer()
+{
+	BYTE *buffer = NULL;
+	Lock(&lock_);
+	if (!free_buffers_.empty())
+	{
+		buffer = free_buffers_.front();
+		free_buffers_.pop_front();
+	}
+	else if (thread_handle_ && allocated_count_ < buffer_count_)
+	{
+		// Page-aligned buffers are allocated on demand and never freed while running
+		buffer = (BYTE*)VirtualAlloc(NULL, buffer_size_, MEM_COMMIT, PAGE_READWRITE);
+		if (buffer)
+			allocated_count_++;
+	}
+	Unlock(&lock_);
+	return buffer;
+}
+
+void DiskWriter::ReleaseBuffer(BYTE *buffer)
+{
+	if (!buffer)
+		return;
+	Lock(&lock_);
+	free_buffers_.push_back(buffer);
+	Unlock(&lock_);
+}
+
+bool DiskWriter::HasFreeBuffer()
+{
+	Lock(&lock_);
+	bool ret_val = !free_buffers_.empty() || (thread_handle_ && allocated_count_ < buffer_count_);
+	Unlock(&lock_);
+	return ret_val;
+}
+
+void DiskWriter::Submit(HANDLE file_handle, unsigned long long offset, 
+						BYTE *buffer, size_t data_offset, size_t size,
+						unsigned long long *flushed_size, unsigned long long flushed_value,
+						volatile LONG *pending_count, volatile LONG *write_error)
+{
+	Request request;
+	request.file_handle_ = file_handle;
+	request.offset_ = offset;
+	request.buffer_ = buffer;
+	request.data_offset_ = data_offset;
+	request.size_ = size;
+	request.flushed_size_ = flushed_size;
+	request.flushed_value_ = flushed_value;
+	request.pending_count_ = pending_count;
+	request.write_error_ = write_error;
+
+	InterlockedIncrement(pending_count);
+	Lock(&lock_);
+	queue_.push_back(request);
+	Unlock(&lock_);
+	SetEvent(queue_event_);
+}
+
+unsigned __stdcall DiskWriter::WriterThread(void *arg)
+{
+	DiskWriter *writer = (DiskWriter*)arg;
+
+	for (;;)
+	{
+		Lock(&writer->lock_);
+		if (writer->queue_.empty())
+		{
+			bool stopping = writer->stopping_;
+			Unlock(&writer->lock_);
+			if (stopping)
+				break;
+			WaitForSingleObject(writer->queue_event_, INFINITE);
+			continue;
+		}
+		Request request = writer->queue_.front();
+		writer->queue_.pop_front();
+		Unlock(&writer->lock_);
+
+		// Positional write: file pointer is not shared by segments
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		LARGE_INTEGER tmp;
+		tmp.QuadPart = request.offset_;
+		overlapped.Offset = tmp.LowPart;
+		overlapped.OffsetHigh = tmp.HighPart;
+		DWORD nr_written;
+		if (!WriteFile(request.file_handle_, request.buffer_ + request.data_offset_, (DWORD)request.size_, 
+				&nr_written, &overlapped))
+		{
+			DWORD error = GetLastError();
+			LOG(("[WriterThread] offset=0x%llx, size=0x%x, error %u\n", 
+				request.offset_, request.size_, error));
+			InterlockedExchange(request.write_error_, error);
+		}
+		else if ((size_t)nr_written != request.size_)
+		{
+			// Short write to a file means that the disk is full
+			LOG(("[WriterThread] offset=0x%llx, size=0x%x, written 0x%x\n", 
+				request.offset_, request.size_, nr_written));
+			InterlockedExchange(request.write_error_, ERROR_DISK_FULL);
+		}
+
+		// Parts of a buffer are written in order; the last one releases it.
+		// Flushed size is saved in download state, so it never covers 
+		// data which have not reached the disk.
+		if (request.flushed_size_)
+		{
+			if (0 == *request.write_error_)
+				AtomicExchange64(request.flushed_size_, request.flushed_value_);
+			writer->ReleaseBuffer(request.buffer_);
+		}
+		InterlockedDecrement(request.pending_count_);
+	}
+
+	_endthreadex(0);
+	return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef _DISKWRITER_H_
+#define _DISKWRITER_H_
+
+#include "common/types.h"
+#include <list>
+
+/**
+ *	Writer thread which takes disk writes off engine thread, so a slow disk
+ *	does not stall network transfers. Data are passed in buffers taken from
+ *	a bounded pool; when all buffers are queued, AcquireBuffer() fails and 
+ *	the caller pauses its transfer until a buffer is written (backpressure).
+ *	Writes are completed in the order they have been submitted.
+ */
+class DiskWriter
+{
+public:
+	DiskWriter();
+
+	virtual ~DiskWriter();
+
+	bool Start(size_t buffer_size, unsigned int buffer_count);
+
+	/**
+	 *	Write queued buffers and stop writer thread.
+	 */
+	void Stop();
+
+	bool IsStarted() { return NULL != thread_handle_; }
+
+	size_t GetBufferSize() { return buffer_size_; }
+
+	/**
+	 *	@return NULL if all buffers are queued for writing
+	 */
+	BYTE *AcquireBuffer();
+
+	void ReleaseBuffer(BYTE *buffer);
+
+	bool HasFreeBuffer();
+
+	/**
+	 *	Queue buffer for writing at the file offset; data start at data_offset
+	 *	of the buffer. The buffer is released when written; then *flushed_size 
+	 *	is set to flushed_value and *pending_count is decremented (it is 
+	 *	incremented here). If flushed_size is NULL, a part of the buffer is 
+	 *	written: the buffer is kept for the next request which writes it.
+	 *	If a write fails, *write_error is set to the error code; *flushed_size 
+	 *	is not updated while *write_error is set.
+	 */
+	void Submit(HANDLE file_handle, unsigned long long offset, 
+				BYTE *buffer, size_t data_offset, size_t size,
+				unsigned long long *flushed_size, unsigned long long flushed_value,
+				volatile LONG *pending_count, volatile LONG *write_error);
+
+private:
+	struct Request {
+		HANDLE file_handle_;
+		unsigned long long offset_;
+		BYTE *buffer_;
+		size_t data_offset_;
+		size_t size_;
+		unsigned long long *flushed_size_;
+		unsigned long long flushed_value_;
+		volatile LONG *pending_count_;
+		volatile LONG *write_error_;
+	};
+
+	lock_t lock_;
+	HANDLE thread_handle_;
+	HANDLE queue_event_; // Set when a request is queued or writer is stopped
+	size_t buffer_size_;
+	unsigned int buffer_count_;
+
+	// Members below: lock_ MUST be held when accessing them
+	std::list<Request> queue_;
+	std::list<BYTE *> free_buffers_;
+	unsigned int allocated_count_;
+	bool stopping_;
+
+	static unsigned __stdcall WriterThread(void *arg);
+};
+
+#endif
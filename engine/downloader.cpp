@@ -16,12 +16,16 @@
 #include "engine/state.h"
 #include "engine/webfile.h"
 #include "engine/webfilesegment.h"
+#include "engine/httpbatch.h"
+#include "engine/diskwriter.h"
+#include "engine/digestverifier.h"
 #include "gui/message.h"
 #include "gui/progressdialog.h"
 #include "gui/unpackdialog.h"
 #include "gui/getfilesdialog.h"
 #include "gui/selectfolder.h"
 #include "common/misc.h"
+#include "common/httppool.h"
 #include "engine/md5.h"
 #include "common/logging.h"
 #include "common/consts.h"
@@ -36,45 +40,78 @@ Downloader::Downloader(const UrlList &url_list, unsigned long long total_size)
 	copy(url_list.begin(), url_list.end(), url_list_.begin());
 	pause_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
 	continue_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
-	stop_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
 	progress_dlg_ = NULL;
 	unpack_dlg_ = NULL;
+	max_connections_ = DEFAULT_MAX_CONNECTIONS;
+	connection_limit_ = max_connections_;
+	auto_connections_ = true;
+	last_throughput_ = 0;
+	last_step_ = 0;
+	hold_count_ = 0;
+	write_buffer_size_ = DEFAULT_WRITE_BUFFER_SIZE;
+	preallocate_ = false;
+	write_mode_ = WRITE_MODE_FILE;
+	SetHttpShare(http_share_.GetHandle());
 	init_ok_ = (NULL != pause_event_ 
 		&& NULL != continue_event_
-		&& NULL != stop_event_);
+		&& engine_.Start());
 }
 
 Downloader::~Downloader(void)
 {
+	StopAllFiles();
+	engine_.Stop();
+	disk_writer_.Stop();
+	// All handles are released now; idle ones are detached from the share
+	SetHttpShare(NULL);
 	if (pause_event_)
 		CloseHandle(pause_event_);
 	if (continue_event_)
 		CloseHandle(continue_event_);
-	if (stop_event_)
-		CloseHandle(stop_event_);
 }
 
 ULONG64 Downloader::EstimateTotalSize()
 {
 	ULONG64 total = 0;
 
+	HttpBatch batch(&engine_, MAX_METADATA_REQUESTS);
 	for (FileDescriptorList::iterator iter = file_desc_list_.begin();
 		iter != file_desc_list_.end(); iter++)
+		batch.Add(iter->url_, true);
+	batch.Start();
+	batch.Wait(INFINITE);
+
+	for (size_t i = 0; i < file_desc_list_.size(); i++)
 	{
 		ULONG64 size;
-		if (HttpGetFileSize(iter->url_, size))
+		if (batch.GetRequest(i).GetContentLength(size))
 			total += size;
 	}
 
 	return total;
 }
 
+/**
+ *	.md5 file holds thread count in the first line and MD5 of parts followed 
+ *	by MD5 of the whole file in next lines. Lines starting with http:// or 
+ *	https:// are mirror URL-s of the file; they can be placed anywhere after 
+ *	the first line. Optional "digest: <algorithm>" line selects another 
+ *	algorithm of the digests (see Digest::ParseType()). Optional 
+ *	"part-size: <bytes>[K|M]" line sets size of parts other than PART_SIZE;
+ *	small parts let a corrupted file be repaired by downloading less data.
+ */
 static bool ParseParameters(std::vector <BYTE> buf, __out unsigned int& thread_count, 
-							__out std::list<string>& md5_list)
+							__out unsigned int& digest_type, 
+							__out unsigned long long& part_size, 
+							__out std::list<string>& md5_list, 
+							__out std::list<string>& mirror_list)
 {
 	string str(buf.begin(), buf.end());
 	bool thread_count_read = false;
+	digest_type = DIGEST_MD5;
+	part_size = PART_SIZE;
 	md5_list.clear();
+	mirror_list.clear();
 	const char newline[] = "\n";
 	for (size_t pos = 0; pos < str.size(); )
 	{
@@ -86,9 +123,43 @@ static bool ParseParameters(std::vector <BYTE> buf, __out unsigned int& thread_c
 			thread_count = atoi((str.substr(pos, new_pos - pos)).c_str());
 			thread_count_read = true;
 		}
+		else if (0 == str.compare(pos, 7, "http://") || 0 == str.compare(pos, 8, "https://"))
+		{
+			string mirror = str.substr(pos, new_pos - pos);
+			size_t end = mirror.find_last_not_of(" \t\r");
+			if (-1 != end)
+				mirror_list.push_back(mirror.substr(0, end + 1));
+		}
+		else if (0 == str.compare(pos, 7, "digest:"))
+		{
+			string name = str.substr(pos + 7, new_pos - pos - 7);
+			size_t begin = name.find_first_not_of(" \t");
+			size_t end = name.find_last_not_of(" \t\r");
+			if (-1 == end || !Digest::ParseType(name.substr(begin, end - begin + 1), digest_type))
+			{
+				LOG(("[ParseParameters] ERROR: Unknown digest: %s\n", name.c_str()));
+				return false;
+			}
+		}
+		else if (0 == str.compare(pos, 10, "part-size:"))
+		{
+			string value = str.substr(pos + 10, new_pos - pos - 10);
+			char *end;
+			part_size = _strtoui64(value.c_str(), &end, 10);
+			if ('K' == toupper(*end))
+				part_size *= 1024;
+			else if ('M' == toupper(*end))
+				part_size *= 1024 * 1024;
+			if (0 == part_size || 0 != part_size % MIN_PART_SIZE)
+			{
+				LOG(("[ParseParameters] ERROR: Invalid part size: %s\n", value.c_str()));
+				return false;
+			}
+		}
 		else
 		{
-			string md5_str = str.substr(pos, min(0x20, new_pos - pos));
+			// Digest length is known at the end; the line is cut then
+			string md5_str = str.substr(pos, min(0x40, new_pos - pos));
 			std::transform(md5_str.begin(), md5_str.end(), md5_str.begin(), std::toupper);
 			md5_list.push_back(md5_str);
 		}
@@ -97,36 +168,23 @@ static bool ParseParameters(std::vector <BYTE> buf, __out unsigned int& thread_c
 		pos = new_pos + sizeof(newline) - 1;
 	}
 
-	return thread_count_read && thread_count > 0 && md5_list.size() > 0;
-}
-
-static bool GetParameters(const std::string& url, __out unsigned int& thread_count, 
-						  __out std::list<string>& md5_list)
-{
-	const std::string param_url = url + ".md5";
-
-	bool ret_val = false;
-
-	vector <BYTE> buf;
-
-	// .md5 files can be generated by script and "Content-Length" HTTP
-	// header can be missed. Use adaptive algorithm with resizing buffer
-	// dynamically during download.
-	 
-	if (HttpReadFileDynamic(param_url, buf))
-		ret_val = ParseParameters(buf, thread_count, md5_list);
+	size_t digest_length = Digest::GetHexLength(digest_type);
+	for (list<string>::iterator iter = md5_list.begin(); iter != md5_list.end(); iter++)
+		iter->resize(min(digest_length, iter->size()));
 
-	return ret_val;
+	return thread_count_read && thread_count > 0 && md5_list.size() > 0;
 }
 
-void FileDescriptor::Update(unsigned int thread_count, std::list<std::string> md5_list)
+void FileDescriptor::Update(unsigned int thread_count, unsigned int digest_type, ULONG64 part_size, 
+							std::list<std::string> md5_list, std::list<std::string> mirror_list)
 {
 	change_flags_ = 0;
 	if (thread_count_ != 0)
 	{
 		if (thread_count != thread_count_)
 			change_flags_ |= FC_THREAD_COUNT;
-		if (md5_list.size() != md5_list_.size())
+		if (md5_list.size() != md5_list_.size() || digest_type != digest_type_ 
+			|| part_size != part_size_)
 			change_flags_ |= FC_MD5;
 		else
 		{
@@ -135,8 +193,12 @@ void FileDescriptor::Update(unsigned int thread_count, std::list<std::string> md
 		}
 	}
 	thread_count_ = thread_count;
+	digest_type_ = digest_type;
+	part_size_ = part_size;
 	md5_list_.resize(md5_list.size());
 	std::copy(md5_list.begin(), md5_list.end(), md5_list_.begin());
+	// Mirrors are applied when file download is (re)started
+	mirror_list_ = mirror_list;
 }
 
 FileDescriptorList::iterator Downloader::FindDescriptor(const string& url)
@@ -152,6 +214,7 @@ FileDescriptorList::iterator Downloader::FindDescriptor(const string& url)
 
 /**
  *	Try to get download information for URL-s specified in the program.
+ *	.md5 files of all URL-s are fetched concurrently.
  *	@return true if any download details were retrieved, false otherwise
  */
 bool Downloader::GetFileDescriptorList(bool show_dialog)
@@ -166,26 +229,43 @@ bool Downloader::GetFileDescriptorList(bool show_dialog)
 		get_files_dlg->Show(true);
 	}
 
-	for (UrlList::iterator url_iter = url_list_.begin(); url_iter != url_list_.end(); url_iter++) 
+	// .md5 files can be generated by script and "Content-Length" HTTP
+	// header can be missed, so they are read to growing buffers
+	HttpBatch batch(&engine_, MAX_METADATA_REQUESTS);
+	UrlList::iterator url_iter;
+	size_t index;
+	for (url_iter = url_list_.begin(); url_iter != url_list_.end(); url_iter++) 
+		batch.Add(*url_iter + ".md5", false);
+	batch.Start();
+	while (!batch.Wait(100))
+	{
+		if (show_dialog && get_files_dlg->WaitForClosing(0))
+		{
+			batch.Cancel();
+			goto __end;
+		}
+	}
+
+	index = 0;
+	for (url_iter = url_list_.begin(); url_iter != url_list_.end(); url_iter++, index++) 
 	{
-		unsigned int thread_count;
-		list<string> md5_list;
-		if (GetParameters(*url_iter, thread_count, md5_list))
+		HttpRequest& request = batch.GetRequest(index);
+		unsigned int thread_count, digest_type;
+		unsigned long long part_size;
+		list<string> md5_list, mirror_list;
+		if (request.IsSucceeded() 
+			&& ParseParameters(request.GetBody(), thread_count, digest_type, part_size, 
+							   md5_list, mirror_list))
 		{
 			FileDescriptorList::iterator file_desc_iter = FindDescriptor(*url_iter);
 			if (file_desc_iter != file_desc_list_.end())
-				file_desc_iter->Update(thread_count, md5_list);
+				file_desc_iter->Update(thread_count, digest_type, part_size, md5_list, mirror_list);
 			else
 			{
 				FileDescriptor file_desc(*url_iter);
-				file_desc.Update(thread_count, md5_list);
+				file_desc.Update(thread_count, digest_type, part_size, md5_list, mirror_list);
 				file_desc_list_.push_back(file_desc);
 			}
-			if (show_dialog && get_files_dlg->WaitForClosing(0))
-			{
-				ret_val = false;
-				goto __end;
-			}
 			ret_val = true;
 		}
 	}
@@ -301,30 +381,6 @@ unsigned int Downloader::UnpackFile(const StlString& fname)
 	return u.Unpack(folder_name_);
 }
 
-FileDescriptorList::iterator Downloader::FindChangedMd5Descriptor()
-{
-	FileDescriptorList::iterator iter;
-
-	for (iter = file_desc_list_.begin(); iter != file_desc_list_.end(); iter++) 
-	{
-		if (iter->change_flags_ & FC_MD5)
-			return iter;
-	}
-
-	return iter;
-}
-
-void Downloader::DeleteChangedFiles()
-{
-	FileDescriptorList::iterator iter;
-
-	for (iter = file_desc_list_.begin(); iter != file_desc_list_.end(); iter++) 
-	{
-		if (iter->change_flags_ & FC_MD5)
-			DeleteFile(iter->file_name_.c_str());
-	}
-}
-
 bool Downloader::CheckNotFinishedDownloads()
 {
 	for (FileDescriptorList::iterator iter = file_desc_list_.begin();
@@ -378,6 +434,45 @@ void Downloader::Run()
 
 	state_.Save();
 
+	// Connection budget can be tuned in downloader.config
+	StlString max_connections;
+	if (state_.GetValue(_T("max_connections"), max_connections) 
+		&& _ttoi(max_connections.c_str()) > 0)
+		max_connections_ = (unsigned int)_ttoi(max_connections.c_str());
+
+	LoadRateLimits();
+
+	// Write-behind buffer of a segment, KB
+	StlString write_buffer_size;
+	if (state_.GetValue(_T("write_buffer_size"), write_buffer_size) 
+		&& _ttoi(write_buffer_size.c_str()) >= 0)
+		write_buffer_size_ = (size_t)_ttoi(write_buffer_size.c_str()) * 1024;
+	// Output files are extended to their full size before data are written
+	StlString preallocate;
+	if (state_.GetValue(_T("preallocate"), preallocate))
+		preallocate_ = (0 != _ttoi(preallocate.c_str()));
+	// Received data are copied to file mapping instead of being written,
+	// or files are written and verified bypassing system cache
+	StlString write_mode;
+	if (state_.GetValue(_T("write_mode"), write_mode))
+	{
+		if (write_mode == _T("mapped"))
+			write_mode_ = WRITE_MODE_MAPPED;
+		else if (write_mode == _T("direct"))
+			write_mode_ = WRITE_MODE_DIRECT;
+	}
+
+	// Data are written unbuffered from engine thread if writer is not started
+	disk_writer_.Start(write_buffer_size_, DISK_WRITER_BUFFERS);
+
+	// Thread counts from .md5 files are used if auto tuning is disabled
+	StlString auto_connections;
+	if (state_.GetValue(_T("auto_connections"), auto_connections))
+		auto_connections_ = (0 != _ttoi(auto_connections.c_str()));
+
+	connection_limit_ = auto_connections_ ? 
+		min(max_connections_, (unsigned int)AUTO_INITIAL_CONNECTIONS) : max_connections_;
+
 	if (!GetFileDescriptorList(true))
 	{
 		// Nothing to do; get out
@@ -393,118 +488,22 @@ void Downloader::Run()
 
 	total_progress_size_ = 0;
 
-	bool abort = false;
-
-	// Try to load download state. If successfully loaded, restart downloading
-	// at the saved point.
-	FileDescriptorList::iterator iter;
-	WebFile loaded_file(pause_event_, continue_event_, stop_event_);
-	if (LoadDownloadState(loaded_file))
+	// Try to load download state. If successfully loaded, files which 
+	// have been downloaded are restarted at the saved point.
+	if (LoadDownloadState())
 	{
 		EstimateTotalProgressFromList();
-		unsigned int status;
-		unsigned long long downloaded_size, increment;
-		loaded_file.GetDownloadStatus(status, downloaded_size, increment);
-		total_progress_size_ += downloaded_size;
-		iter = FindDescriptor(loaded_file.GetUrl());
-		if (iter != file_desc_list_.end())
-		{
-			StlString wurl(iter->url_.begin(), iter->url_.end());
-
-			progress_dlg_->SetDisplayedData(wurl, 0, 0, 0);
-
-			if (DownloadFile(iter->url_, loaded_file))
-			{
-				if (CheckMd5(iter->url_, iter->file_name_))
-				{
-					iter->finished_ = true;
-					GetDiskFileSize(iter->file_name_, iter->file_size_);
-				}
-			}
-		}
-	}
-
-__restart:
-
-	for (iter = file_desc_list_.begin(); iter != file_desc_list_.end(); )
-	{
-		StlString file_name;
-		if (iter->finished_)
-			goto __next_iteration;
-
-		if (!GetFileNameFromUrl(iter->url_, iter->file_name_))
-			return;
-
-		unsigned int download_status = PerformDownload(*iter);
-		if (STATUS_DOWNLOAD_FINISHED == download_status)
-		{
-			if (CheckMd5(iter->url_, iter->file_name_))
-			{
-				iter->finished_ = true;
-				GetDiskFileSize(iter->file_name_, iter->file_size_);
-			}
-			else
-			{
-				StlString broken_url = StlString(iter->url_.begin(), iter->url_.end());
-				Message::Show(
-					StlString(_T("File \r\n")) 
-					+ broken_url
-					+ StlString(_T("\r\n is corrupted. Please contact support service.")));
-				abort = true;
-				break;
-			}
-		}
-		else if (STATUS_INIT_FAILED == download_status)
-		{
-			Message::Show(_T("Internal program error. Please contact support service.\r\n"));
-			abort = true;
-			break;
-		}
-		else if (STATUS_INVALID_URL == download_status)
-		{
-			LOG(("Invalid URL: %s. Try to download this file next time\r\n", 
-				iter->url_));
-		}
-		else if (STATUS_DOWNLOAD_FAILURE == download_status)
+		for (ActiveFileList::iterator iter = active_files_.begin(); 
+			iter != active_files_.end(); iter++)
 		{
-			LOG(("Download failure for URL: %s. Try to download this file next time\r\n", 
-				iter->url_));
+			unsigned int status;
+			unsigned long long downloaded_size, increment;
+			iter->file_->GetDownloadStatus(status, downloaded_size, increment);
+			total_progress_size_ += downloaded_size;
 		}
-		else if (STATUS_FILE_CREATE_FAILURE == download_status)
-		{
-			Message::Show(StlString(_T("Unable to create file for URL "))
-				+ StlString(iter->url_.begin(), iter->url_.end()));
-			abort = true;
-			break;
-		}
-		else if (STATUS_DOWNLOAD_STOPPED == download_status) // Stopped by user
-		{
-			abort = true; // Silently exit
-			break;
-		}
-		else if (STATUS_MD5_CHANGED == download_status)
-		{
-			Message::Show(
-				StlString(_T("Certain files have been changed on the server during \r\n")
-				_T("the download process. They will be redownloaded.")));
-
-			DeleteChangedFiles();
-
-			// Roll back to changed MD5.
-			iter = FindChangedMd5Descriptor();
-			continue;
-		}
-
-__next_iteration:
-		iter++;
 	}
 
-	// Restart until all files are downloaded
-	if (!abort && CheckNotFinishedDownloads())
-	{
-		Sleep(100);
-		goto __restart;
-	}
+	bool abort = !DownloadFiles();
 
 	progress_dlg_->Close();
 	progress_dlg_->WaitForClosing(INFINITE);
@@ -600,35 +599,88 @@ static DWORD64 GetTimeDiff(const FILETIME& ft)
 	return time;
 }
 
-bool Downloader::CheckFileDescriptors(const std::string& current_url, 
-									  __out bool& md5_changed, 
-									  __out bool& thread_count_changed, 
-									  __out unsigned int& new_thread_count)
+/**
+ *	Re-read download information.
+ *	@return true if any file descriptor has been changed
+ */
+bool Downloader::CheckFileDescriptors()
+{
+	if (!GetFileDescriptorList(false))
+		return false;
+
+	for (FileDescriptorList::iterator iter = file_desc_list_.begin(); 
+		iter != file_desc_list_.end(); iter++) 
+	{
+		if (iter->change_flags_ & (FC_MD5 | FC_THREAD_COUNT))
+			return true;
+	}
+	return false;
+}
+
+/**
+ *	Files with changed MD5 are stopped (if being downloaded), deleted and 
+ *	redownloaded. Thread count changes are applied to files in flight.
+ */
+void Downloader::ProcessChangedFiles()
 {
-	md5_changed = false;
-	thread_count_changed = false;
-	if (GetFileDescriptorList(false))
+	bool md5_changed = false;
+
+	for (FileDescriptorList::iterator iter = file_desc_list_.begin(); 
+		iter != file_desc_list_.end(); iter++) 
 	{
-		bool md5_changed = false;
-		for (FileDescriptorList::iterator iter = file_desc_list_.begin(); 
-			iter != file_desc_list_.end(); iter++) 
+		if (iter->change_flags_ & FC_MD5)
 		{
-			if (iter->change_flags_ & FC_MD5)
-				md5_changed = true;
-			if (iter->url_ == current_url)
+			md5_changed = true;
+			for (ActiveFileList::iterator active_iter = active_files_.begin(); 
+				active_iter != active_files_.end(); active_iter++)
 			{
-				if (iter->change_flags_ & FC_THREAD_COUNT)
+				if (active_iter->url_ == iter->url_)
 				{
-					thread_count_changed = true;
-					new_thread_count = iter->thread_count_;
+					unsigned int status;
+					unsigned long long downloaded_size, increment;
+					active_iter->file_->GetDownloadStatus(status, downloaded_size, increment);
+					if (total_progress_size_ + increment >= downloaded_size)
+						total_progress_size_ -= downloaded_size - increment;
+					StopFile(active_iter);
+					break;
 				}
-				break;
 			}
+			if (iter->finished_)
+			{
+				iter->finished_ = false;
+				total_progress_size_ -= min(total_progress_size_, iter->file_size_);
+			}
+			DeleteFile(iter->file_name_.c_str());
 		}
-		return md5_changed || thread_count_changed;
+		iter->change_flags_ = 0;
+	}
+
+	// Ranges in flight are kept for files with changed thread count
+	AllocateConnections();
+
+	if (md5_changed)
+	{
+		Message::Show(
+			StlString(_T("Certain files have been changed on the server during \r\n")
+			_T("the download process. They will be redownloaded.")));
 	}
-	else
-		return false;
+}
+
+// Rate limit from downloader.config, KB/sec. Missing or 0 value means no limit.
+static unsigned long long GetRateLimit(State& state, const StlString& key_name)
+{
+	StlString value;
+	if (!state.GetValue(key_name, value))
+		return 0;
+	__int64 rate = _ttoi64(value.c_str());
+	return (rate > 0) ? (unsigned long long)rate * 1024 : 0;
+}
+
+void Downloader::LoadRateLimits()
+{
+	limiter_.SetGlobalLimit(GetRateLimit(state_, _T("max_rate")));
+	limiter_.SetDefaultFileLimit(GetRateLimit(state_, _T("max_file_rate")));
+	limiter_.SetDefaultHostLimit(GetRateLimit(state_, _T("max_host_rate")));
 }
 
 bool Downloader::GetFileNameFromUrl(const std::string& url, __out StlString& fname)
@@ -655,112 +707,481 @@ bool Downloader::GetFileNameFromUrl(const std::string& url, __out StlString& fna
 	return true;
 }
 
-unsigned int Downloader::DownloadFile(std::string url, WebFile& file)
+void Downloader::DeleteActiveFile(const ActiveFile& active_file)
 {
-	bool md5_changed = false;
-	// Check .md5 updates every 10 min. Save download state every 1 sec.
-	const DWORD64 SAVE_PERIOD = 1000, MD5_CHECK_PERIOD = 10 * 60 * 1000; 
-	unsigned int ret_val = STATUS_DOWNLOAD_FAILURE;
+	delete active_file.file_;
+	if (active_file.stop_event_)
+		CloseHandle(active_file.stop_event_);
+}
+
+unsigned int Downloader::GetThreadLimit(const ActiveFile& active_file)
+{
+	if (auto_connections_)
+	{
+		// Ranges smaller than MIN_SPLIT_SIZE are not split
+		unsigned long long size = active_file.file_->GetSize();
+		unsigned long long downloaded_size = active_file.file_->GetDownloadedSize();
+		unsigned long long range_count = 
+			(size > downloaded_size) ? (size - downloaded_size) / MIN_SPLIT_SIZE + 1 : 1;
+		return (unsigned int)min(range_count, (unsigned long long)connection_limit_);
+	}
+
+	FileDescriptorList::iterator desc_iter = FindDescriptor(active_file.url_);
+	if (desc_iter == file_desc_list_.end() || 0 == desc_iter->thread_count_)
+		return 1;
+	return desc_iter->thread_count_;
+}
+
+bool Downloader::IsActiveUrl(const std::string& url)
+{
+	for (ActiveFileList::iterator iter = active_files_.begin(); 
+		iter != active_files_.end(); iter++)
+	{
+		if (iter->url_ == url)
+			return true;
+	}
+	return false;
+}
+
+bool Downloader::RepairFile(const FileDescriptor& file_desc, const std::vector<size_t>& failed_parts, 
+							unsigned int repair_count)
+{
+	unsigned long long file_size;
+	if (!GetDiskFileSize(file_desc.file_name_, file_size))
+		return false;
+
+	// Adjacent parts are merged into one range; ranges are split among connections
+	list<pair<unsigned long long, unsigned long long> > ranges;
+	unsigned long long repair_size = 0;
+	for (size_t i = 0; i < failed_parts.size(); i++)
+	{
+		unsigned long long offset = failed_parts[i] * file_desc.part_size_;
+		if (offset >= file_size)
+			return false;
+		unsigned long long size = min(file_desc.part_size_, file_size - offset);
+		if (!ranges.empty() && ranges.back().first + ranges.back().second == offset)
+			ranges.back().second += size;
+		else
+			ranges.push_back(make_pair(offset, size));
+		repair_size += size;
+	}
+
+	ActiveFile active_file;
+	active_file.url_ = file_desc.url_;
+	active_file.repair_parts_ = failed_parts;
+	active_file.repair_count_ = repair_count;
+	active_file.stop_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!active_file.stop_event_)
+		return false;
+	active_file.file_ = new WebFile(&engine_, &limiter_, file_desc.url_, file_desc.file_name_, 1, 
+		pause_event_, continue_event_, active_file.stop_event_);
+	active_file.file_->SetMirrors(file_desc.mirror_list_);
+	active_file.file_->SetRepairRanges(file_size, ranges);
+
+	if (!StartFile(active_file))
+	{
+		DeleteActiveFile(active_file);
+		return false;
+	}
+	// Repaired data are counted in progress once more
+	total_progress_size_ -= min(total_progress_size_, repair_size);
+	return true;
+}
+
+bool Downloader::StartFile(const ActiveFile& active_file)
+{
+	active_file.file_->SetDiskWriter(&disk_writer_);
+	active_file.file_->SetPreallocate(preallocate_);
+	active_file.file_->SetWriteMode(write_mode_);
+	FileDescriptorList::iterator file_desc_iter = FindDescriptor(active_file.url_);
+	if (file_desc_iter != file_desc_list_.end())
+		active_file.file_->SetDigestParameters(file_desc_iter->digest_type_, file_desc_iter->part_size_);
+	if (!active_file.file_->Start())
+		return false;
+	active_files_.push_back(active_file);
+	AllocateConnections();
+	return true;
+}
+
+/**
+ *	Launch the next not finished file if connection budget is not exhausted.
+ *	Files which could not be started are added to failed_urls.
+ *	@return false if download should be aborted
+ */
+bool Downloader::StartNextFile(std::list<std::string>& failed_urls, __out bool& started)
+{
+	started = false;
+
+	unsigned int connection_count = 0;
+	for (ActiveFileList::iterator iter = active_files_.begin(); 
+		iter != active_files_.end(); iter++)
+		connection_count += GetThreadLimit(*iter);
+	if (connection_count >= connection_limit_)
+		return true;
+
+	for (FileDescriptorList::iterator iter = file_desc_list_.begin(); 
+		iter != file_desc_list_.end(); iter++) 
+	{
+		if (iter->finished_ || IsActiveUrl(iter->url_)
+			|| failed_urls.end() != find(failed_urls.begin(), failed_urls.end(), iter->url_))
+			continue;
+
+		if (!GetFileNameFromUrl(iter->url_, iter->file_name_))
+			return false;
+
+		ActiveFile active_file;
+		active_file.url_ = iter->url_;
+		active_file.stop_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (!active_file.stop_event_)
+			return false;
+		// Connections are allocated as soon as file size is known
+		active_file.file_ = new WebFile(&engine_, &limiter_, iter->url_, iter->file_name_, 1, 
+			pause_event_, continue_event_, active_file.stop_event_);
+		active_file.file_->SetMirrors(iter->mirror_list_);
+
+		if (!StartFile(active_file))
+		{
+			LOG(("Could not start download for URL: %s. Try to download this file next time\r\n", 
+				iter->url_.c_str()));
+			DeleteActiveFile(active_file);
+			failed_urls.push_back(iter->url_);
+			continue;
+		}
+
+		StlString wurl(iter->url_.begin(), iter->url_.end());
+		progress_dlg_->SetDisplayedData(wurl, 0, 0, 0);
+
+		started = true;
+		break;
+	}
+
+	return true;
+}
+
+void Downloader::StopFile(ActiveFileList::iterator iter)
+{
+	iter->file_->Stop();
+	if (!iter->file_->WaitForFinish(1000))
+		iter->file_->Terminate();
+	DeleteActiveFile(*iter);
+	active_files_.erase(iter);
+}
+
+void Downloader::StopAllFiles()
+{
+	while (!active_files_.empty())
+		StopFile(active_files_.begin());
+}
+
+void Downloader::AllocateConnections()
+{
+	size_t file_count = active_files_.size();
+	if (0 == file_count)
+		return;
 
-	if (!file.Start())
-		return ret_val;
+	vector<unsigned long long> remaining(file_count);
+	vector<unsigned int> limit(file_count), allocated(file_count, 1);
+	unsigned int free_connections = 
+		(connection_limit_ > file_count) ? (unsigned int)(connection_limit_ - file_count) : 0;
 
-	FILETIME ft_start, ft_current, ft_md5_check, ft_save;
+	ActiveFileList::iterator iter;
+	size_t i;
+	for (iter = active_files_.begin(), i = 0; iter != active_files_.end(); iter++, i++)
+	{
+		unsigned long long downloaded_size = iter->file_->GetDownloadedSize();
+		unsigned long long size = iter->file_->GetSize();
+		remaining[i] = (size > downloaded_size) ? size - downloaded_size : 0;
+		limit[i] = GetThreadLimit(*iter);
+	}
+
+	// Every free connection goes to the file with the most remaining bytes 
+	// per connection, thus connections are shared proportionally to remaining sizes
+	for ( ; free_connections > 0; free_connections--)
+	{
+		size_t best = file_count;
+		for (i = 0; i < file_count; i++)
+		{
+			if (allocated[i] >= limit[i])
+				continue;
+			if (best == file_count 
+				|| remaining[i] * allocated[best] > remaining[best] * allocated[i])
+				best = i;
+		}
+		if (best == file_count)
+			break;
+		allocated[best]++;
+	}
+
+	for (iter = active_files_.begin(), i = 0; iter != active_files_.end(); iter++, i++)
+	{
+		if (iter->file_->GetThreadCount() != allocated[i])
+			iter->file_->UpdateThreadCount(allocated[i]);
+	}
+}
+
+/**
+ *	Hill climbing on aggregate throughput. Connections are added while 
+ *	throughput grows; the last step is rolled back when throughput reaches 
+ *	a plateau, and connections are cut when they fail. Ranges in flight 
+ *	are not restarted: extra connections are dropped as their ranges finish.
+ */
+void Downloader::AdaptConnections(unsigned long long received_size, DWORD64 period, 
+								  unsigned int error_count)
+{
+	double throughput = (double)received_size / (period ? period : 1);
+	unsigned int limit = connection_limit_;
+
+	if (error_count)
+	{
+		limit = max(1u, limit * 3 / 4);
+		last_step_ = 0;
+		hold_count_ = AUTO_HOLD_PERIODS;
+	}
+	else if (last_step_ && throughput < last_throughput_ * (100 + AUTO_MIN_GAIN) / 100)
+	{
+		limit -= min(limit - 1, last_step_);
+		last_step_ = 0;
+		hold_count_ = AUTO_HOLD_PERIODS;
+	}
+	else if (hold_count_)
+	{
+		last_step_ = 0;
+		hold_count_--;
+	}
+	else
+	{
+		// Probe: add a quarter of connections
+		last_step_ = min(max(1u, limit / 4), max_connections_ - min(limit, max_connections_));
+		limit += last_step_;
+	}
+	last_throughput_ = throughput;
+
+	LOG(("[AdaptConnections] throughput=%.1f KB/s, errors=%u, connections: %u -> %u\n", 
+		throughput * 1000 / 1024, error_count, connection_limit_, limit));
+
+	if (limit != connection_limit_)
+	{
+		connection_limit_ = limit;
+		AllocateConnections();
+	}
+}
+
+bool Downloader::DownloadFiles()
+{
+	// Check .md5 updates every 10 min. Save download state every 1 sec.
+	// Tune connection count every 3 sec. Re-read rate limits every 5 sec.
+	const DWORD64 SAVE_PERIOD = 1000, MD5_CHECK_PERIOD = 10 * 60 * 1000, ADAPT_PERIOD = 3000, 
+		CONFIG_CHECK_PERIOD = 5000; 
+
+	FILETIME ft_start, ft_current, ft_md5_check, ft_save, ft_adapt, ft_config;
+	GetTime(ft_config);
 	GetTime(ft_save);
 	GetTime(ft_md5_check);
 	GetTime(ft_start);
+	GetTime(ft_adapt);
+	unsigned long long adapt_size = 0;
+
+	// Files which could not be downloaded are retried 
+	// after all other files have been processed
+	list<string> failed_urls;
 
-	unsigned int status;
-	unsigned long long downloaded_size, download_size_increment = 0;
+	unsigned long long download_size_increment = 0;
 	for ( ; ; )
 	{
+		if (progress_dlg_->WaitForClosing(0))
+		{
+			// Stopped by user
+			SaveDownloadState();
+			StopAllFiles();
+			return false;
+		}
+
+		bool started;
+		do {
+			if (!StartNextFile(failed_urls, started))
+			{
+				StopAllFiles();
+				return false;
+			}
+		} while (started);
+
+		if (active_files_.empty())
+		{
+			// Restart until all files are downloaded
+			if (!CheckNotFinishedDownloads())
+				break;
+			failed_urls.clear();
+			Sleep(100);
+			continue;
+		}
+
 		if (GetTimeDiff(ft_save) >= SAVE_PERIOD)
 		{
 			GetTime(ft_save);
-			SaveDownloadState(file);
+			SaveDownloadState();
+			AllocateConnections();
+		}
+		if (GetTimeDiff(ft_config) >= CONFIG_CHECK_PERIOD)
+		{
+			// Rate limits can be changed while downloading
+			GetTime(ft_config);
+			if (state_.Load())
+				LoadRateLimits();
 		}
 		if (GetTimeDiff(ft_md5_check) >= MD5_CHECK_PERIOD)
 		{
 			GetTime(ft_md5_check);
-			bool thread_count_changed;
-			unsigned int new_thread_count;
-			if (CheckFileDescriptors(url, md5_changed, thread_count_changed, new_thread_count))
+			if (CheckFileDescriptors())
 			{
-				if (!md5_changed && thread_count_changed)
-				{
-					// Changed thread count for current file.
-					// Restart current part of file.
-					file.UpdateThreadCount(new_thread_count);
-				}
-				else 
-				{
-					// Changed MD5 for one of earlier downloaded files or for this file.
-					// Stop downloading this file.
-					file.Stop();
-					if (!file.WaitForFinish(1000))
-						file.Terminate();
-					ResetEvent(stop_event_);
-					// Show message if redownloading
-					ret_val = STATUS_MD5_CHANGED;
-					break;
-				}
+				ProcessChangedFiles();
+				continue;
 			}
 		}
+
 		GetTime(ft_current);
-		unsigned long long increment;
-		file.GetDownloadStatus(status, downloaded_size, increment);
-		download_size_increment += increment;
-		total_progress_size_ += increment;
+		unsigned int status;
+		unsigned long long downloaded_size, increment, displayed_size = 0;
+		for (ActiveFileList::iterator iter = active_files_.begin(); 
+			iter != active_files_.end(); iter++)
+		{
+			iter->file_->GetDownloadStatus(status, downloaded_size, increment);
+			download_size_increment += increment;
+			total_progress_size_ += increment;
+			adapt_size += increment;
+			if (iter == active_files_.begin())
+				displayed_size = downloaded_size;
+		}
 		if (WAIT_OBJECT_0 == WaitForSingleObject(pause_event_, 0))
 		{
 			// Re-initialize data for speed calculation, if paused
 			GetTime(ft_start);
 			download_size_increment = 0;
+			GetTime(ft_adapt);
+			adapt_size = 0;
 		}
 		else
 		{
-			// Do not update progress if paused
-			ShowProgress(StlString(url.begin(), url.end()), downloaded_size, 
-				download_size_increment, file.GetSize(), ft_start, ft_current);
-		}
-		if (file.WaitForFinish(0))
-		{
-			file.GetDownloadStatus(ret_val, downloaded_size, increment);
-			if (STATUS_DOWNLOAD_FINISHED != ret_val)
-				LOG(("[PerformDownload] File is not downloaded. URL: %s, download status: 0x%x\n", 
-				url.c_str(), status));
-			break;
+			// Do not update progress if paused. Speed is summed up for all 
+			// files; the earliest launched file is displayed.
+			ActiveFile& displayed = active_files_.front();
+			ShowProgress(StlString(displayed.url_.begin(), displayed.url_.end()), displayed_size, 
+				download_size_increment, displayed.file_->GetSize(), ft_start, ft_current);
+
+			if (auto_connections_ && GetTimeDiff(ft_adapt) >= ADAPT_PERIOD)
+			{
+				unsigned int error_count = 0;
+				for (ActiveFileList::iterator iter = active_files_.begin(); 
+					iter != active_files_.end(); iter++)
+					error_count += iter->file_->GetErrorCount();
+				AdaptConnections(adapt_size, GetTimeDiff(ft_adapt), error_count);
+				GetTime(ft_adapt);
+				adapt_size = 0;
+			}
 		}
-		if (progress_dlg_->WaitForClosing(0))
+
+		for (ActiveFileList::iterator iter = active_files_.begin(); 
+			iter != active_files_.end(); )
 		{
-			file.Stop();
-			if (!file.WaitForFinish(1000))
-				file.Terminate();
-			ret_val = STATUS_DOWNLOAD_STOPPED;
-			break;
+			if (!iter->file_->WaitForFinish(0))
+			{
+				iter++;
+				continue;
+			}
+
+			iter->file_->GetDownloadStatus(status, downloaded_size, increment);
+			total_progress_size_ += increment;
+			string url = iter->url_;
+			vector<size_t> repair_parts = iter->repair_parts_;
+			unsigned int repair_count = iter->repair_count_;
+			// File is read to be verified only if it has not been hashed while downloading
+			vector<string> part_digests;
+			string file_digest;
+			bool hashed = iter->file_->GetDigests(part_digests, file_digest);
+			ActiveFileList::iterator next = iter;
+			next++;
+			StopFile(iter);
+			iter = next;
+
+			if (STATUS_DOWNLOAD_FINISHED != status)
+				LOG(("[DownloadFiles] File is not downloaded. URL: %s, download status: 0x%x\n", 
+					url.c_str(), status));
+
+			FileDescriptorList::iterator desc_iter = FindDescriptor(url);
+			if (desc_iter == file_desc_list_.end())
+				continue;
+
+			if (STATUS_DOWNLOAD_FINISHED == status)
+			{
+				// Only repaired parts are read after repair; the rest have been verified
+				vector<size_t> failed_parts;
+				bool verified;
+				if (!repair_parts.empty())
+					verified = CheckParts(desc_iter->url_, desc_iter->file_name_, repair_parts, failed_parts);
+				else if (hashed)
+					verified = CheckDigests(desc_iter->url_, part_digests, file_digest, failed_parts);
+				else
+					verified = CheckMd5(desc_iter->url_, desc_iter->file_name_, failed_parts);
+
+				if (verified)
+				{
+					desc_iter->finished_ = true;
+					GetDiskFileSize(desc_iter->file_name_, desc_iter->file_size_);
+					// Free connections go to the files in flight
+					AllocateConnections();
+				}
+				else if (!failed_parts.empty() && repair_count < MAX_REPAIR_COUNT 
+					&& RepairFile(*desc_iter, failed_parts, repair_count + 1))
+				{
+					LOG(("[DownloadFiles] %u parts of %s are downloaded again\n", 
+						(unsigned int)failed_parts.size(), url.c_str()));
+				}
+				else
+				{
+					StlString broken_url = StlString(url.begin(), url.end());
+					Message::Show(
+						StlString(_T("File \r\n")) 
+						+ broken_url
+						+ StlString(_T("\r\n is corrupted. Please contact support service.")));
+					StopAllFiles();
+					return false;
+				}
+			}
+			else if (STATUS_INIT_FAILED == status)
+			{
+				Message::Show(_T("Internal program error. Please contact support service.\r\n"));
+				StopAllFiles();
+				return false;
+			}
+			else if (STATUS_FILE_CREATE_FAILURE == status)
+			{
+				Message::Show(StlString(_T("Unable to create file for URL "))
+					+ StlString(url.begin(), url.end()));
+				StopAllFiles();
+				return false;
+			}
+			else if (STATUS_NO_DISK_SPACE == status)
+			{
+				Message::Show(StlString(_T("Not enough disk space for URL "))
+					+ StlString(url.begin(), url.end()));
+				StopAllFiles();
+				return false;
+			}
+			else
+			{
+				LOG(("Download failure for URL: %s. Try to download this file next time\r\n", 
+					url.c_str()));
+				failed_urls.push_back(url);
+			}
 		}
+
 		Sleep(100);
 	}
 
-	return ret_val;
-
-}
-
-unsigned int Downloader::PerformDownload(FileDescriptor& file_desc)
-{
-	StlString tmp, fname, wurl;
-
-	wurl = StlString(file_desc.url_.begin(), file_desc.url_.end());
-
-	progress_dlg_->SetDisplayedData(wurl, 0, 0, 0);
-
-	WebFile file(file_desc.url_, file_desc.file_name_, file_desc.thread_count_, 
-		pause_event_, continue_event_, stop_event_);
-
-	return DownloadFile(file_desc.url_, file);
+	return true;
 }
 
-bool Downloader::CheckMd5(const std::string& url, const StlString& file_name)
+bool Downloader::CheckMd5(const std::string& url, const StlString& file_name, 
+						  __out std::vector<size_t>& failed_parts)
 {
 	FileDescriptorList::iterator file_desc_iter = FindDescriptor(url);
 	if (file_desc_iter == file_desc_list_.end())
@@ -769,85 +1190,42 @@ bool Downloader::CheckMd5(const std::string& url, const StlString& file_name)
 		return false;
 	}
 
-	HANDLE file_handle = OpenOrCreate(file_name, GENERIC_READ);
-	if (INVALID_HANDLE_VALUE == file_handle)
-	{
-		LOG(("[CheckMd5] ERROR: Could not open file: %S\n", 
-			std::wstring(file_name.begin(), file_name.end()).c_str()));
-		return false;
-	}
-
-	MD5 file_md5;
-	file_md5.reset();
-
-	bool ret_val = true;
-
-	vector <BYTE> buf;
-
-	const unsigned int BUF_SIZE = 1024 * 1024;
-	buf.resize(BUF_SIZE);
+	// Parts are hashed by all processors
+	DigestVerifier verifier(file_name, file_desc_iter->digest_type_, file_desc_iter->part_size_, 
+		file_desc_iter->md5_list_, WRITE_MODE_DIRECT == write_mode_);
+	bool ret_val = verifier.Verify(0);
+	failed_parts = verifier.GetFailedParts();
+	return ret_val;
+}
 
-	ULARGE_INTEGER offset, size;
-	size.LowPart = GetFileSize(file_handle, &size.HighPart);
-	list<string>::iterator md5_iter = file_desc_iter->md5_list_.begin();
-	for (offset.QuadPart = 0; offset.QuadPart < size.QuadPart; 
-								offset.QuadPart += PART_SIZE, md5_iter++) 
+bool Downloader::CheckParts(const std::string& url, const StlString& file_name, 
+							const std::vector<size_t>& parts, __out std::vector<size_t>& failed_parts)
+{
+	FileDescriptorList::iterator file_desc_iter = FindDescriptor(url);
+	if (file_desc_iter == file_desc_list_.end())
 	{
-		DWORD read_size;
-
-		MD5 part_md5;
-		part_md5.reset();
-
-		ULONG64 pos = 0;
-		do {
-			if (ReadFile(file_handle, &buf[0], BUF_SIZE, &read_size, NULL))
-			{
-				LOG(("Read OK, pos=0x%llx, read_size=0x%x\n", pos, read_size));
-				file_md5.append(&buf[0], read_size);
-				part_md5.append(&buf[0], read_size);
-
-				pos += read_size;
-
-				if (pos == PART_SIZE || read_size != BUF_SIZE)
-				{
-					part_md5.finish();
-					string md5_str = part_md5.getFingerprint();
-					if (md5_str != *md5_iter)
-					{
-						// MD5 is wrong
-						ret_val = false;
-						goto __end;
-					}
-					break;
-				}
-			}
-			else
-			{
-				ret_val = false;
-				goto __end;
-			}
-		} while (read_size == BUF_SIZE);
-
-		if (distance(md5_iter, file_desc_iter->md5_list_.end()) == 1)
-		{
-			// MD5 list is too short
-			ret_val = false;
-			goto __end;
-		}
+		LOG(("[CheckParts] ERROR: File descriptor not found for URL %s\n", url.c_str()));
+		return false;
 	}
 
-	file_md5.finish();
+	DigestVerifier verifier(file_name, file_desc_iter->digest_type_, file_desc_iter->part_size_, 
+		file_desc_iter->md5_list_, WRITE_MODE_DIRECT == write_mode_);
+	bool ret_val = verifier.VerifyParts(parts, 0);
+	failed_parts = verifier.GetFailedParts();
+	return ret_val;
+}
 
-	if (ret_val && md5_iter != file_desc_iter->md5_list_.end())
+bool Downloader::CheckDigests(const std::string& url, const std::vector<std::string>& part_digests, 
+							  const std::string& file_digest, __out std::vector<size_t>& failed_parts)
+{
+	FileDescriptorList::iterator file_desc_iter = FindDescriptor(url);
+	if (file_desc_iter == file_desc_list_.end())
 	{
-		// Check total MD5
-		if (file_md5.getFingerprint() != *md5_iter)
-			ret_val = false;
+		LOG(("[CheckDigests] ERROR: File descriptor not found for URL %s\n", url.c_str()));
+		return false;
 	}
-__end:
-	CloseHandle(file_handle);
 
-	return ret_val;
+	return DigestVerifier::Compare(file_desc_iter->md5_list_, part_digests, file_digest, failed_parts);
 }
 
 void Downloader::ShowProgress(const StlString& url, 
@@ -861,9 +1239,11 @@ void Downloader::ShowProgress(const StlString& url,
 
 	unsigned long long tmp_total_size = total_size_http_ ? total_size_http_ : total_size_;
 
-	total_progress = (unsigned int)((100 * total_progress_size_ /* + file_downloaded_size */) / tmp_total_size);
+	// Sizes are 0 until servers report them
+	total_progress = tmp_total_size ? 
+		(unsigned int)((100 * total_progress_size_ /* + file_downloaded_size */) / tmp_total_size) : 0;
 
-	file_progress = (unsigned int)((100 * file_downloaded_size) / file_size);
+	file_progress = file_size ? (unsigned int)((100 * file_downloaded_size) / file_size) : 0;
 
 	// Time, microseconds
 	ULONG64 time = (*(ULONG64*)&ft_current - *(ULONG64*)&ft_start) / 10;
@@ -877,17 +1257,43 @@ void Downloader::ShowProgress(const StlString& url,
 	progress_dlg_->SetDisplayedData(url, speed, file_progress, total_progress);
 }
 
-bool Downloader::LoadDownloadState(__out WebFile& file)
+// First value of download state holding several files. Legacy download 
+// state starts with file descriptor list and holds one file.
+#define DOWNLOAD_STATE_MAGIC 0x46444D44
+
+/**
+ *	Read file descriptor list and files which have been downloaded.
+ *	Files are created (not started) and added to files list.
+ */
+bool Downloader::ReadDownloadState(bool legacy, __out ActiveFileList& files)
 {
 	bool ret_val = true;
 	ifstream ifs;
 	try {
 		ifs.open("downloader.state", ios_base::in);
 		boost::archive::text_iarchive ia(ifs);
+		unsigned int file_count = 1;
+		if (!legacy)
+		{
+			unsigned int magic;
+			ia >> magic;
+			if (DOWNLOAD_STATE_MAGIC != magic)
+				return false;
+			ia >> file_count;
+		}
 		ia >> file_desc_list_;
-		file.Down();
-		ia >> file;
-		file.Up();
+		for (unsigned int i = 0; i < file_count; i++)
+		{
+			ActiveFile active_file;
+			active_file.stop_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+			active_file.file_ = new WebFile(&engine_, &limiter_, 
+				pause_event_, continue_event_, active_file.stop_event_);
+			files.push_back(active_file);
+			active_file.file_->Down();
+			ia >> *active_file.file_;
+			active_file.file_->Up();
+			files.back().url_ = active_file.file_->GetUrl();
+		}
 		ifs.close();
 	}
 	catch (boost::archive::archive_exception& ) {
@@ -896,12 +1302,42 @@ bool Downloader::LoadDownloadState(__out WebFile& file)
 	return ret_val;
 }
 
+bool Downloader::LoadDownloadState()
+{
+	ActiveFileList files;
+	bool ret_val = ReadDownloadState(false, files);
+	if (!ret_val)
+	{
+		for_each(files.begin(), files.end(), DeleteActiveFile);
+		files.clear();
+		ret_val = ReadDownloadState(true, files);
+	}
+
+	for (ActiveFileList::iterator iter = files.begin(); iter != files.end(); iter++)
+	{
+		FileDescriptorList::iterator desc_iter = FindDescriptor(iter->url_);
+		if (!ret_val 
+			|| desc_iter == file_desc_list_.end() 
+			|| desc_iter->finished_ 
+			|| !iter->stop_event_)
+		{
+			DeleteActiveFile(*iter);
+			continue;
+		}
+		iter->file_->SetMirrors(desc_iter->mirror_list_);
+		if (!StartFile(*iter))
+			DeleteActiveFile(*iter);
+	}
+
+	return ret_val;
+}
+
 void Downloader::EraseDownloadState()
 {
 	DeleteFileA("downloader.state");
 }
 
-bool Downloader::SaveDownloadState(WebFile& file)
+bool Downloader::SaveDownloadState()
 {
 	bool ret_val = true;
 	ofstream ofs;
@@ -909,10 +1345,20 @@ bool Downloader::SaveDownloadState(WebFile& file)
 	try {
 		ofs.open("downloader.state", ios_base::out);
 		boost::archive::text_oarchive oa(ofs);
+		unsigned int magic = DOWNLOAD_STATE_MAGIC;
+		unsigned int file_count = (unsigned int)active_files_.size();
+		oa << magic;
+		oa << file_count;
 		oa << file_desc_list_;
-		file.Down();
-		oa << file;
-		file.Up();
+		for (ActiveFileList::iterator iter = active_files_.begin(); 
+			iter != active_files_.end(); iter++)
+		{
+			// Buffered data are not saved; they are in the file by the next save
+			iter->file_->FlushBuffers();
+			iter->file_->Down();
+			oa << *iter->file_;
+			iter->file_->Up();
+		}
 		ofs.close();
 	}
 	catch (boost::archive::archive_exception& ) {
@@ -3,11 +3,18 @@
 
 #include <tchar.h>
 #include "common/types.h"
+#include "common/consts.h"
 #include "engine/state.h"
+#include "engine/transferengine.h"
+#include "engine/ratelimiter.h"
+#include "engine/diskwriter.h"
+#include "engine/digest.h"
+#include "common/httpshare.h"
 #include <string>
 #include <list>
 #include <boost/serialization/access.hpp>
 #include <boost/serialization/split_member.hpp>
+#include <boost/serialization/version.hpp>
 
 typedef std::vector <std::string> UrlList;
 
@@ -23,20 +30,26 @@ struct FileDescriptor {
 	std::string url_;
 	StlString file_name_;
 	unsigned int thread_count_;
-	std::list<std::string> md5_list_;
+	std::list<std::string> md5_list_;    // Digests of parts and of the whole file
+	unsigned int digest_type_;           // Algorithm of md5_list_, DIGEST_XXX
+	ULONG64 part_size_;                  // Size of parts of md5_list_
+	std::list<std::string> mirror_list_; // Equivalent URL-s of the file (url_ is not included)
 	unsigned int change_flags_;
 	ULONG64 file_size_;
 	FileDescriptor(std::string& url)
 		: url_(url), thread_count_(0), change_flags_(0), 
-		finished_(false), file_name_(_T("")), file_size_(0)
+		finished_(false), file_name_(_T("")), file_size_(0), digest_type_(DIGEST_MD5), 
+			part_size_(PART_SIZE)
 	{
 	}
 	FileDescriptor()
 		: url_(""), thread_count_(0), change_flags_(0), 
-		finished_(false), file_name_(_T("")), file_size_(0)
+		finished_(false), file_name_(_T("")), file_size_(0), digest_type_(DIGEST_MD5), 
+			part_size_(PART_SIZE)
 	{
 	}
-	void Update(unsigned int thread_count, std::list<std::string> md5_list);
+	void Update(unsigned int thread_count, unsigned int digest_type, ULONG64 part_size, 
+				std::list<std::string> md5_list, std::list<std::string> mirror_list);
 
 	friend class boost::serialization::access;
 
@@ -49,12 +62,15 @@ struct FileDescriptor {
 		ar & thread_count_;
 		ar & md5_list_;
 		ar & file_size_;
+		ar & mirror_list_;
+		ar & digest_type_;
+		ar & part_size_;
 	}
 
 	template<class Archive>
 	void load(Archive & ar, const unsigned int version)
 	{
-		if (version > 0)
+		if (version > 3)
 			return;
 		ar & finished_;
 		ar & url_;
@@ -62,12 +78,22 @@ struct FileDescriptor {
 		ar & thread_count_;
 		ar & md5_list_;
 		ar & file_size_;
+		if (version > 0)
+			ar & mirror_list_;
+		digest_type_ = DIGEST_MD5;
+		if (version > 1)
+			ar & digest_type_;
+		part_size_ = PART_SIZE;
+		if (version > 2)
+			ar & part_size_;
 		change_flags_ = 0;
 	}
 	BOOST_SERIALIZATION_SPLIT_MEMBER()
 
 };
 
+BOOST_CLASS_VERSION(FileDescriptor, 3)
+
 typedef std::list <FileDescriptor> FileDescriptorList;
 
 class WebFile;
@@ -93,17 +119,10 @@ private:
 
 	FileDescriptorList::iterator FindDescriptor(const std::string& url);
 
-	void DeleteChangedFiles();
-
-	bool CheckFileDescriptors(const std::string& current_url, 
-							  __out bool& md5_changed, 
-							  __out bool& thread_count_changed, 
-							  __out unsigned int& new_thread_count);
+	bool CheckFileDescriptors();
 
 	bool CheckNotFinishedDownloads();
 
-	FileDescriptorList::iterator FindChangedMd5Descriptor();
-
 	UrlList url_list_;
 
 	unsigned long long total_size_; // Total size preconfigures inside program
@@ -113,7 +132,6 @@ private:
 
 	HANDLE pause_event_;
 	HANDLE continue_event_;
-	HANDLE stop_event_;
 
 	bool init_ok_;
 
@@ -121,14 +139,110 @@ private:
 
 	State state_;
 
+	HttpShare http_share_; // DNS, SSL sessions and cookies of all handles
+
+	TransferEngine engine_;
+
+	RateLimiter limiter_; // Bandwidth limits are set in downloader.config
+
+	DiskWriter disk_writer_; // Writes buffered data of all files
+
+	/**
+	 *	File which is being downloaded. Every active file has its own 
+	 *	stop event, so it can be stopped without affecting the others.
+	 */
+	struct ActiveFile {
+		std::string url_;
+		WebFile *file_;
+		HANDLE stop_event_;
+		std::vector<size_t> repair_parts_; // Parts which are downloaded again, if repaired
+		unsigned int repair_count_;        // Repairs of the file so far
+		ActiveFile() : file_(NULL), stop_event_(NULL), repair_count_(0) {}
+	};
+	typedef std::list <ActiveFile> ActiveFileList;
+
+	ActiveFileList active_files_;
+
+	unsigned int max_connections_;  // Upper limit of connections shared by active files
+	size_t write_buffer_size_;      // Write-behind buffer of a segment
+	bool preallocate_;              // Reserve disk space for files before download
+	unsigned int write_mode_;       // WRITE_MODE_XXX
+	unsigned int connection_limit_; // Connections shared by active files now
+	bool auto_connections_;         // connection_limit_ is tuned by measured throughput
+
+	// Throughput controller state (auto_connections_ mode)
+	double last_throughput_;
+	unsigned int last_step_;  // Connections added by the last probe
+	unsigned int hold_count_; // Periods left until the next probe
+
 	bool SelectFolderName(void);
 
 	bool IsEnoughFreeSpace(void);
 
-	unsigned int PerformDownload(FileDescriptor& file_desc);
-	unsigned int DownloadFile(std::string url, WebFile& file);
-
-	bool CheckMd5(const std::string& url, const StlString& file_name);
+	/**
+	 *	Download not finished files concurrently. Files are launched while 
+	 *	the sum of their thread limits fits into connection_limit_.
+	 *	@return false if download has been aborted
+	 */
+	bool DownloadFiles();
+
+	bool StartFile(const ActiveFile& active_file);
+	bool StartNextFile(std::list<std::string>& failed_urls, __out bool& started);
+	void StopFile(ActiveFileList::iterator iter);
+	static void DeleteActiveFile(const ActiveFile& active_file);
+	void StopAllFiles();
+	bool IsActiveUrl(const std::string& url);
+
+	/**
+	 *	Number of connections which may be opened to the file: thread count
+	 *	from .md5 file, or the number of ranges left in auto_connections_ mode.
+	 */
+	unsigned int GetThreadLimit(const ActiveFile& active_file);
+
+	/**
+	 *	Distribute connection_limit_ among active files proportionally to 
+	 *	their remaining sizes. Every file gets one connection at least and 
+	 *	no more than its thread limit.
+	 */
+	void AllocateConnections();
+
+	/**
+	 *	Tune connection_limit_ by aggregate throughput measured for 
+	 *	the last period (auto_connections_ mode).
+	 */
+	void AdaptConnections(unsigned long long received_size, DWORD64 period, 
+						  unsigned int error_count);
+
+	void ProcessChangedFiles();
+
+	void LoadRateLimits();
+
+	/**
+	 *	Verification of downloaded file by digest list of its descriptor.
+	 *	@param failed_parts [out]	Parts which do not match their digests
+	 */
+	bool CheckMd5(const std::string& url, const StlString& file_name, 
+				  __out std::vector<size_t>& failed_parts);
+
+	/**
+	 *	Compare digests computed by WebFile while downloading with digest list.
+	 */
+	bool CheckDigests(const std::string& url, const std::vector<std::string>& part_digests, 
+					  const std::string& file_digest, __out std::vector<size_t>& failed_parts);
+
+	/**
+	 *	Verify parts of the file which have been repaired.
+	 */
+	bool CheckParts(const std::string& url, const StlString& file_name, 
+					const std::vector<size_t>& parts, __out std::vector<size_t>& failed_parts);
+
+	/**
+	 *	Download corrupted parts of the finished file again. The file is 
+	 *	verified as soon as the parts are downloaded.
+	 *	@return false if repair could not be started
+	 */
+	bool RepairFile(const FileDescriptor& file_desc, const std::vector<size_t>& failed_parts, 
+					unsigned int repair_count);
 
 	ProgressDialog *progress_dlg_;
 	UnpackDialog *unpack_dlg_;
@@ -143,8 +257,9 @@ private:
 
 	ULONG64 EstimateTotalSize();
 
-	bool LoadDownloadState(__out WebFile& file);
-	bool SaveDownloadState(WebFile& file);
+	bool ReadDownloadState(bool legacy, __out ActiveFileList& files);
+	bool LoadDownloadState();
+	bool SaveDownloadState();
 	void EraseDownloadState();
 
 	bool GetFileNameFromUrl(const std::string& url, __out StlString& fname);
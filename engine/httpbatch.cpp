@@ -0,0 +1,199 @@
+#include <windows.h>
+#include <tchar.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <list>
+using namespace std;
+
+#include "engine/httpbatch.h"
+#include "common/misc.h"
+#include "common/httppool.h"
+#include "common/redirectcache.h"
+#include "common/logging.h"
+
+// Files are assumed not to be greater than 256MB when read to memory
+#define MAX_BODY_SIZE 0x10000000
+
+HttpRequest::HttpRequest(HttpBatch *batch, const std::string& url, bool head)
+: batch_(batch), url_(url), head_(head)
+{
+	http_handle_ = NULL;
+	content_length_ = 0;
+	content_length_read_ = false;
+	succeeded_ = false;
+}
+
+HttpRequest::~HttpRequest()
+{
+	Cleanup();
+}
+
+bool HttpRequest::Start()
+{
+	request_url_ = ResolveUrl(url_);
+	http_handle_ = AcquireHttpHandle(request_url_);
+	if (!http_handle_)
+		return false;
+
+	curl_easy_setopt(http_handle_, CURLOPT_URL, request_url_.c_str());
+	curl_easy_setopt(http_handle_, CURLOPT_MAXREDIRS, 500);
+	curl_easy_setopt(http_handle_, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(http_handle_, CURLOPT_FAILONERROR, 1);
+	if (head_)
+		curl_easy_setopt(http_handle_, CURLOPT_NOBODY, 1);
+	curl_easy_setopt(http_handle_, CURLOPT_WRITEFUNCTION, WriteCallback);
+	curl_easy_setopt(http_handle_, CURLOPT_WRITEDATA, this);
+	curl_easy_setopt(http_handle_, CURLOPT_HEADERFUNCTION, HeaderCallback);
+	curl_easy_setopt(http_handle_, CURLOPT_WRITEHEADER, this);
+	SetProxyForHttpHandle(http_handle_);
+
+	batch_->GetEngine()->Add(this);
+	return true;
+}
+
+void HttpRequest::Cleanup()
+{
+	if (http_handle_)
+	{
+		ReleaseHttpHandle(request_url_, http_handle_);
+		http_handle_ = NULL;
+	}
+}
+
+bool HttpRequest::GetContentLength(__out unsigned long long& size)
+{
+	if (!succeeded_ || !content_length_read_)
+		return false;
+	size = content_length_;
+	return true;
+}
+
+size_t HttpRequest::WriteCallback(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+	HttpRequest *request = (HttpRequest*)userp;
+	size_t nr_write = size * nmemb;
+	if (request->body_.size() + nr_write > MAX_BODY_SIZE)
+		return 0;
+	request->body_.insert(request->body_.end(), (BYTE*)buffer, (BYTE*)buffer + nr_write);
+	return nmemb;
+}
+
+size_t HttpRequest::HeaderCallback(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+	HttpRequest *request = (HttpRequest*)userp;
+	string header_str((char*)buffer, size * nmemb);
+	const string content_header_str = "content-length:";
+
+	// Headers of every redirect hop are passed here; the last response counts
+	if (0 == header_str.compare(0, 5, "HTTP/"))
+		request->content_length_read_ = false;
+	else if (header_str.size() > content_header_str.size()
+		&& 0 == _strnicmp(header_str.c_str(), content_header_str.c_str(), content_header_str.size()))
+	{
+		request->content_length_ =
+			_strtoui64(header_str.c_str() + content_header_str.size(), NULL, 10);
+		request->content_length_read_ = true;
+	}
+	return nmemb;
+}
+
+void HttpRequest::OnDone(CURLcode result)
+{
+	succeeded_ = (CURLE_OK == result);
+	if (succeeded_)
+		StoreRedirectTarget(url_, http_handle_);
+	else
+	{
+		LOG(("[HttpRequest::OnDone] %s: error %u\n", request_url_.c_str(), result));
+		if (request_url_ != url_)
+			ForgetRedirectTarget(url_);
+	}
+	Cleanup();
+	batch_->NotifyRequestDone(this);
+}
+
+HttpBatch::HttpBatch(TransferEngine *engine, unsigned int max_in_flight)
+: engine_(engine), max_in_flight_(max_in_flight)
+{
+	InitLock(&lock_);
+	next_request_ = 0;
+	in_flight_ = 0;
+	done_count_ = 0;
+	cancelled_ = false;
+	done_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+HttpBatch::~HttpBatch()
+{
+	Cancel();
+	for (size_t i = 0; i < requests_.size(); i++)
+		delete requests_[i];
+	if (done_event_)
+		CloseHandle(done_event_);
+	CloseLock(&lock_);
+}
+
+size_t HttpBatch::Add(const std::string& url, bool head)
+{
+	requests_.push_back(new HttpRequest(this, url, head));
+	return requests_.size() - 1;
+}
+
+void HttpBatch::Start()
+{
+	Lock(&lock_);
+	StartNext();
+	Unlock(&lock_);
+}
+
+void HttpBatch::StartNext()
+{
+	while (!cancelled_ && in_flight_ < max_in_flight_ && next_request_ < requests_.size())
+	{
+		HttpRequest *request = requests_[next_request_++];
+		if (request->Start())
+			in_flight_++;
+		else
+			done_count_++;
+	}
+
+	if (done_count_ == requests_.size() || (cancelled_ && 0 == in_flight_))
+		SetEvent(done_event_);
+}
+
+void HttpBatch::NotifyRequestDone(HttpRequest *request)
+{
+	Lock(&lock_);
+	in_flight_--;
+	done_count_++;
+	StartNext();
+	Unlock(&lock_);
+}
+
+bool HttpBatch::Wait(DWORD timeout)
+{
+	return WAIT_OBJECT_0 == WaitForSingleObject(done_event_, timeout);
+}
+
+void HttpBatch::Cancel()
+{
+	Lock(&lock_);
+	cancelled_ = true;
+	// Requests in flight are the started ones which still hold handles
+	list<HttpRequest *> in_flight;
+	for (size_t i = 0; i < next_request_; i++)
+		if (requests_[i]->http_handle_)
+			in_flight.push_back(requests_[i]);
+	Unlock(&lock_);
+
+	// Do not hold lock_ here: engine thread may wait for it in NotifyRequestDone
+	for (list<HttpRequest *>::iterator iter = in_flight.begin(); iter != in_flight.end(); iter++)
+	{
+		engine_->Remove(*iter);
+		(*iter)->Cleanup();
+	}
+
+	SetEvent(done_event_);
+}
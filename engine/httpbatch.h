@@ -0,0 +1,112 @@
+#ifndef _HTTPBATCH_H_
+#define _HTTPBATCH_H_
+
+#include "common/types.h"
+#include <vector>
+#include "curl/curl.h"
+#include "engine/transferengine.h"
+
+class HttpBatch;
+
+/**
+ *	Single request of HttpBatch. Body is read to memory (GET),
+ *	or file size is taken from response headers (HEAD).
+ */
+class HttpRequest : public Transfer
+{
+public:
+	HttpRequest(HttpBatch *batch, const std::string& url, bool head);
+
+	virtual ~HttpRequest();
+
+	bool Start();
+
+	const std::string& GetUrl() { return url_; }
+
+	bool IsSucceeded() { return succeeded_; }
+
+	std::vector<BYTE>& GetBody() { return body_; }
+
+	bool GetContentLength(__out unsigned long long& size);
+
+	/* Transfer interface (called from engine thread) */
+	virtual CURL *GetHttpHandle() { return http_handle_; }
+	virtual bool OnTick() { return true; }
+	virtual void OnDone(CURLcode result);
+
+private:
+	HttpBatch *batch_;
+	std::string url_;
+	std::string request_url_; // Cached redirect target of url_, or url_ itself
+	bool head_;
+	CURL *http_handle_;
+	std::vector<BYTE> body_;
+	unsigned long long content_length_;
+	bool content_length_read_;
+	bool succeeded_;
+
+	void Cleanup();
+
+	friend class HttpBatch;
+
+	// CURL callbacks
+	static size_t WriteCallback(void *buffer, size_t size, size_t nmemb, void *userp);
+	static size_t HeaderCallback(void *buffer, size_t size, size_t nmemb, void *userp);
+};
+
+/**
+ *	Requests performed concurrently by transfer engine, not more than
+ *	max_in_flight of them at once. Handles are taken from the connection
+ *	pool, so requests to the same host reuse connections.
+ */
+class HttpBatch
+{
+public:
+	HttpBatch(TransferEngine *engine, unsigned int max_in_flight);
+
+	virtual ~HttpBatch();
+
+	/**
+	 *	Queue request. Must be called before Start().
+	 *	@return request index
+	 */
+	size_t Add(const std::string& url, bool head);
+
+	void Start();
+
+	/**
+	 *	Wait until all requests are done.
+	 *	@return false on timeout
+	 */
+	bool Wait(DWORD timeout);
+
+	/**
+	 *	Drop requests in flight and the ones which are not started yet.
+	 */
+	void Cancel();
+
+	HttpRequest& GetRequest(size_t index) { return *requests_[index]; }
+
+	TransferEngine *GetEngine() { return engine_; }
+
+protected:
+
+	void NotifyRequestDone(HttpRequest *request); // Called from engine thread
+
+private:
+	lock_t lock_;
+	TransferEngine *engine_;
+	unsigned int max_in_flight_;
+	std::vector<HttpRequest *> requests_;
+	size_t next_request_;    // lock_ MUST be held when accessing this member
+	unsigned int in_flight_; // lock_ MUST be held when accessing this member
+	size_t done_count_;      // lock_ MUST be held when accessing this member
+	bool cancelled_;
+	HANDLE done_event_;
+
+	void StartNext(); // lock_ MUST be held when calling this method
+
+	friend class HttpRequest;
+};
+
+#endif
@@ -34,6 +34,7 @@
 
 #include <Windows.h>
 #include <tchar.h>
+#include <stdio.h>
 #include <string.h>
 #include <string>
 using namespace std;
@@ -43,10 +44,22 @@ using namespace std;
 
 #include "md5.h"
 
+/*
+ * Only the 4-lane SSE2 kernel is provided: the compiler used for this
+ * project (VS2005) has no AVX2/AVX-512 intrinsics and cannot save YMM/ZMM
+ * registers, so wider 8/16-lane kernels cannot be built here.
+ */
+#if defined(_M_IX86) || defined(_M_X64)
+#   define MD5_SSE2
+#   include <intrin.h>
+#   include <emmintrin.h>
+#endif
+
 /*
  * Compile with -DMD5_TEST to create a self-contained executable test program.
  * The test program should print out the same values as given in section
- * A.5 of RFC 1321, reproduced below.
+ * A.5 of RFC 1321, reproduced below, and check that multi-buffer lanes
+ * give the same digests.
  */
 
 #ifdef MD5_TEST
@@ -77,6 +90,34 @@ main()
             cout << hex << setw(2) << setfill('0') << (int)myMD5.getDigest()[di];
         cout << endl;
     }
+
+    /* Messages of different lengths, several blocks each. */
+    MD5 multiMD5[MD5_LANES];
+    MD5* lanes[MD5_LANES];
+    string msg[MD5_LANES];
+    const void* data[MD5_LANES];
+    int nbytes[MD5_LANES];
+    for (int lane = 0; lane < MD5_LANES; ++lane)
+    {
+        for (int r = 0; r < 64 * (lane + 1); ++r)
+            msg[lane] += test[3 + lane % 4];
+        lanes[lane] = &multiMD5[lane];
+        data[lane] = msg[lane].data();
+        nbytes[lane] = (int)msg[lane].size();
+    }
+    MD5::appendMulti(lanes, data, nbytes, MD5_LANES);
+
+    bool multiOK = true;
+    for (int lane = 0; lane < MD5_LANES; ++lane)
+    {
+        MD5 myMD5;
+        myMD5.append(data[lane], nbytes[lane]);
+        myMD5.finish();
+        multiMD5[lane].finish();
+        if (memcmp(myMD5.getDigest(), multiMD5[lane].getDigest(), 16))
+            multiOK = false;
+    }
+    cout << "Multi-buffer MD5: " << (multiOK ? "OK" : "FAILED") << endl;
     return 0;
 }
 #endif  /* MD5_TEST */
@@ -146,6 +187,33 @@ main()
 #define T63 0x2ad7d2bb
 #define T64 0xeb86d391
 
+/* Basic MD5 functions; every step is expanded inline. */
+#define MD5_FF(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_GG(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define MD5_HH(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_II(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5_ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define MD5_SET(f, a, b, c, d, k, s, Ti) \
+    a += f(b, c, d) + X[k] + (Ti); \
+    a = MD5_ROTATE_LEFT(a, s) + b
+
+#ifdef MD5_SSE2
+
+/* The same functions for MD5_LANES messages, one in every 32-bit lane. */
+#define MD5_FF_SSE2(x, y, z) _mm_or_si128(_mm_and_si128(x, y), _mm_andnot_si128(x, z))
+#define MD5_GG_SSE2(x, y, z) _mm_or_si128(_mm_and_si128(x, z), _mm_andnot_si128(z, y))
+#define MD5_HH_SSE2(x, y, z) _mm_xor_si128(_mm_xor_si128(x, y), z)
+#define MD5_II_SSE2(x, y, z) _mm_xor_si128(y, _mm_or_si128(x, _mm_xor_si128(z, ones)))
+
+#define MD5_SET_SSE2(f, a, b, c, d, k, s, Ti) \
+    a = _mm_add_epi32(a, _mm_add_epi32(_mm_add_epi32(f##_SSE2(b, c, d), X[k]), \
+                                       _mm_set1_epi32((int)(Ti)))); \
+    a = _mm_add_epi32(_mm_or_si128(_mm_slli_epi32(a, s), _mm_srli_epi32(a, 32 - (s))), b)
+
+#endif  /* MD5_SSE2 */
+
 MD5::MD5()
 {
     reset();
@@ -205,85 +273,85 @@ MD5::process(const md5_byte_t data[64])
     /* Let [abcd k s i] denote the operation
        a = b + ((a + F(b,c,d) + X[k] + T[i]) <<< s). */
     /* Do the following 16 operations. */
-    SET(&MD5::F, a, b, c, d,  0,  7,  T1);
-    SET(&MD5::F, d, a, b, c,  1, 12,  T2);
-    SET(&MD5::F, c, d, a, b,  2, 17,  T3);
-    SET(&MD5::F, b, c, d, a,  3, 22,  T4);
-    SET(&MD5::F, a, b, c, d,  4,  7,  T5);
-    SET(&MD5::F, d, a, b, c,  5, 12,  T6);
-    SET(&MD5::F, c, d, a, b,  6, 17,  T7);
-    SET(&MD5::F, b, c, d, a,  7, 22,  T8);
-    SET(&MD5::F, a, b, c, d,  8,  7,  T9);
-    SET(&MD5::F, d, a, b, c,  9, 12, T10);
-    SET(&MD5::F, c, d, a, b, 10, 17, T11);
-    SET(&MD5::F, b, c, d, a, 11, 22, T12);
-    SET(&MD5::F, a, b, c, d, 12,  7, T13);
-    SET(&MD5::F, d, a, b, c, 13, 12, T14);
-    SET(&MD5::F, c, d, a, b, 14, 17, T15);
-    SET(&MD5::F, b, c, d, a, 15, 22, T16);
+    MD5_SET(MD5_FF, a, b, c, d,  0,  7,  T1);
+    MD5_SET(MD5_FF, d, a, b, c,  1, 12,  T2);
+    MD5_SET(MD5_FF, c, d, a, b,  2, 17,  T3);
+    MD5_SET(MD5_FF, b, c, d, a,  3, 22,  T4);
+    MD5_SET(MD5_FF, a, b, c, d,  4,  7,  T5);
+    MD5_SET(MD5_FF, d, a, b, c,  5, 12,  T6);
+    MD5_SET(MD5_FF, c, d, a, b,  6, 17,  T7);
+    MD5_SET(MD5_FF, b, c, d, a,  7, 22,  T8);
+    MD5_SET(MD5_FF, a, b, c, d,  8,  7,  T9);
+    MD5_SET(MD5_FF, d, a, b, c,  9, 12, T10);
+    MD5_SET(MD5_FF, c, d, a, b, 10, 17, T11);
+    MD5_SET(MD5_FF, b, c, d, a, 11, 22, T12);
+    MD5_SET(MD5_FF, a, b, c, d, 12,  7, T13);
+    MD5_SET(MD5_FF, d, a, b, c, 13, 12, T14);
+    MD5_SET(MD5_FF, c, d, a, b, 14, 17, T15);
+    MD5_SET(MD5_FF, b, c, d, a, 15, 22, T16);
 
      /* Round 2. */
      /* Let [abcd k s i] denote the operation
           a = b + ((a + G(b,c,d) + X[k] + T[i]) <<< s). */
      /* Do the following 16 operations. */
-    SET(&MD5::G, a, b, c, d,  1,  5, T17);
-    SET(&MD5::G, d, a, b, c,  6,  9, T18);
-    SET(&MD5::G, c, d, a, b, 11, 14, T19);
-    SET(&MD5::G, b, c, d, a,  0, 20, T20);
-    SET(&MD5::G, a, b, c, d,  5,  5, T21);
-    SET(&MD5::G, d, a, b, c, 10,  9, T22);
-    SET(&MD5::G, c, d, a, b, 15, 14, T23);
-    SET(&MD5::G, b, c, d, a,  4, 20, T24);
-    SET(&MD5::G, a, b, c, d,  9,  5, T25);
-    SET(&MD5::G, d, a, b, c, 14,  9, T26);
-    SET(&MD5::G, c, d, a, b,  3, 14, T27);
-    SET(&MD5::G, b, c, d, a,  8, 20, T28);
-    SET(&MD5::G, a, b, c, d, 13,  5, T29);
-    SET(&MD5::G, d, a, b, c,  2,  9, T30);
-    SET(&MD5::G, c, d, a, b,  7, 14, T31);
-    SET(&MD5::G, b, c, d, a, 12, 20, T32);
+    MD5_SET(MD5_GG, a, b, c, d,  1,  5, T17);
+    MD5_SET(MD5_GG, d, a, b, c,  6,  9, T18);
+    MD5_SET(MD5_GG, c, d, a, b, 11, 14, T19);
+    MD5_SET(MD5_GG, b, c, d, a,  0, 20, T20);
+    MD5_SET(MD5_GG, a, b, c, d,  5,  5, T21);
+    MD5_SET(MD5_GG, d, a, b, c, 10,  9, T22);
+    MD5_SET(MD5_GG, c, d, a, b, 15, 14, T23);
+    MD5_SET(MD5_GG, b, c, d, a,  4, 20, T24);
+    MD5_SET(MD5_GG, a, b, c, d,  9,  5, T25);
+    MD5_SET(MD5_GG, d, a, b, c, 14,  9, T26);
+    MD5_SET(MD5_GG, c, d, a, b,  3, 14, T27);
+    MD5_SET(MD5_GG, b, c, d, a,  8, 20, T28);
+    MD5_SET(MD5_GG, a, b, c, d, 13,  5, T29);
+    MD5_SET(MD5_GG, d, a, b, c,  2,  9, T30);
+    MD5_SET(MD5_GG, c, d, a, b,  7, 14, T31);
+    MD5_SET(MD5_GG, b, c, d, a, 12, 20, T32);
 
      /* Round 3. */
      /* Let [abcd k s t] denote the operation
           a = b + ((a + H(b,c,d) + X[k] + T[i]) <<< s). */
      /* Do the following 16 operations. */
-    SET(&MD5::H, a, b, c, d,  5,  4, T33);
-    SET(&MD5::H, d, a, b, c,  8, 11, T34);
-    SET(&MD5::H, c, d, a, b, 11, 16, T35);
-    SET(&MD5::H, b, c, d, a, 14, 23, T36);
-    SET(&MD5::H, a, b, c, d,  1,  4, T37);
-    SET(&MD5::H, d, a, b, c,  4, 11, T38);
-    SET(&MD5::H, c, d, a, b,  7, 16, T39);
-    SET(&MD5::H, b, c, d, a, 10, 23, T40);
-    SET(&MD5::H, a, b, c, d, 13,  4, T41);
-    SET(&MD5::H, d, a, b, c,  0, 11, T42);
-    SET(&MD5::H, c, d, a, b,  3, 16, T43);
-    SET(&MD5::H, b, c, d, a,  6, 23, T44);
-    SET(&MD5::H, a, b, c, d,  9,  4, T45);
-    SET(&MD5::H, d, a, b, c, 12, 11, T46);
-    SET(&MD5::H, c, d, a, b, 15, 16, T47);
-    SET(&MD5::H, b, c, d, a,  2, 23, T48);
+    MD5_SET(MD5_HH, a, b, c, d,  5,  4, T33);
+    MD5_SET(MD5_HH, d, a, b, c,  8, 11, T34);
+    MD5_SET(MD5_HH, c, d, a, b, 11, 16, T35);
+    MD5_SET(MD5_HH, b, c, d, a, 14, 23, T36);
+    MD5_SET(MD5_HH, a, b, c, d,  1,  4, T37);
+    MD5_SET(MD5_HH, d, a, b, c,  4, 11, T38);
+    MD5_SET(MD5_HH, c, d, a, b,  7, 16, T39);
+    MD5_SET(MD5_HH, b, c, d, a, 10, 23, T40);
+    MD5_SET(MD5_HH, a, b, c, d, 13,  4, T41);
+    MD5_SET(MD5_HH, d, a, b, c,  0, 11, T42);
+    MD5_SET(MD5_HH, c, d, a, b,  3, 16, T43);
+    MD5_SET(MD5_HH, b, c, d, a,  6, 23, T44);
+    MD5_SET(MD5_HH, a, b, c, d,  9,  4, T45);
+    MD5_SET(MD5_HH, d, a, b, c, 12, 11, T46);
+    MD5_SET(MD5_HH, c, d, a, b, 15, 16, T47);
+    MD5_SET(MD5_HH, b, c, d, a,  2, 23, T48);
 
      /* Round 4. */
      /* Let [abcd k s t] denote the operation
           a = b + ((a + I(b,c,d) + X[k] + T[i]) <<< s). */
      /* Do the following 16 operations. */
-    SET(&MD5::I, a, b, c, d,  0,  6, T49);
-    SET(&MD5::I, d, a, b, c,  7, 10, T50);
-    SET(&MD5::I, c, d, a, b, 14, 15, T51);
-    SET(&MD5::I, b, c, d, a,  5, 21, T52);
-    SET(&MD5::I, a, b, c, d, 12,  6, T53);
-    SET(&MD5::I, d, a, b, c,  3, 10, T54);
-    SET(&MD5::I, c, d, a, b, 10, 15, T55);
-    SET(&MD5::I, b, c, d, a,  1, 21, T56);
-    SET(&MD5::I, a, b, c, d,  8,  6, T57);
-    SET(&MD5::I, d, a, b, c, 15, 10, T58);
-    SET(&MD5::I, c, d, a, b,  6, 15, T59);
-    SET(&MD5::I, b, c, d, a, 13, 21, T60);
-    SET(&MD5::I, a, b, c, d,  4,  6, T61);
-    SET(&MD5::I, d, a, b, c, 11, 10, T62);
-    SET(&MD5::I, c, d, a, b,  2, 15, T63);
-    SET(&MD5::I, b, c, d, a,  9, 21, T64);
+    MD5_SET(MD5_II, a, b, c, d,  0,  6, T49);
+    MD5_SET(MD5_II, d, a, b, c,  7, 10, T50);
+    MD5_SET(MD5_II, c, d, a, b, 14, 15, T51);
+    MD5_SET(MD5_II, b, c, d, a,  5, 21, T52);
+    MD5_SET(MD5_II, a, b, c, d, 12,  6, T53);
+    MD5_SET(MD5_II, d, a, b, c,  3, 10, T54);
+    MD5_SET(MD5_II, c, d, a, b, 10, 15, T55);
+    MD5_SET(MD5_II, b, c, d, a,  1, 21, T56);
+    MD5_SET(MD5_II, a, b, c, d,  8,  6, T57);
+    MD5_SET(MD5_II, d, a, b, c, 15, 10, T58);
+    MD5_SET(MD5_II, c, d, a, b,  6, 15, T59);
+    MD5_SET(MD5_II, b, c, d, a, 13, 21, T60);
+    MD5_SET(MD5_II, a, b, c, d,  4,  6, T61);
+    MD5_SET(MD5_II, d, a, b, c, 11, 10, T62);
+    MD5_SET(MD5_II, c, d, a, b,  2, 15, T63);
+    MD5_SET(MD5_II, b, c, d, a,  9, 21, T64);
 
      /* Then perform the following additions. (That is increment each
         of the four registers by the value it had before this block
@@ -294,6 +362,133 @@ MD5::process(const md5_byte_t data[64])
     abcd[3] += d;
 }
 
+#ifdef MD5_SSE2
+
+static bool
+md5_has_sse2()
+{
+    static int has_sse2 = -1;
+    if (has_sse2 < 0)
+    {
+        int info[4];
+        __cpuid(info, 1);
+        has_sse2 = (info[3] >> 26) & 1;
+    }
+    return 0 != has_sse2;
+}
+
+/*
+ * Process nblocks of MD5_LANES messages in parallel. Lane i of state[j]
+ * holds abcd[j] of message i; data[i] are the blocks of message i.
+ */
+static void
+md5_process_sse2(md5_word_t state[4][MD5_LANES], const md5_byte_t* data[MD5_LANES], int nblocks)
+{
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i a = _mm_loadu_si128((const __m128i*)state[0]);
+    __m128i b = _mm_loadu_si128((const __m128i*)state[1]);
+    __m128i c = _mm_loadu_si128((const __m128i*)state[2]);
+    __m128i d = _mm_loadu_si128((const __m128i*)state[3]);
+
+    for (int block = 0; block < nblocks; ++block)
+    {
+        /* Word k of every message goes to lane of the message. */
+        __m128i X[16];
+        const md5_word_t* x0 = (const md5_word_t*)(data[0] + 64 * block);
+        const md5_word_t* x1 = (const md5_word_t*)(data[1] + 64 * block);
+        const md5_word_t* x2 = (const md5_word_t*)(data[2] + 64 * block);
+        const md5_word_t* x3 = (const md5_word_t*)(data[3] + 64 * block);
+        for (int k = 0; k < 16; ++k)
+            X[k] = _mm_set_epi32((int)x3[k], (int)x2[k], (int)x1[k], (int)x0[k]);
+
+        __m128i aa = a, bb = b, cc = c, dd = d;
+
+        /* Round 1. */
+        MD5_SET_SSE2(MD5_FF, a, b, c, d,  0,  7,  T1);
+        MD5_SET_SSE2(MD5_FF, d, a, b, c,  1, 12,  T2);
+        MD5_SET_SSE2(MD5_FF, c, d, a, b,  2, 17,  T3);
+        MD5_SET_SSE2(MD5_FF, b, c, d, a,  3, 22,  T4);
+        MD5_SET_SSE2(MD5_FF, a, b, c, d,  4,  7,  T5);
+        MD5_SET_SSE2(MD5_FF, d, a, b, c,  5, 12,  T6);
+        MD5_SET_SSE2(MD5_FF, c, d, a, b,  6, 17,  T7);
+        MD5_SET_SSE2(MD5_FF, b, c, d, a,  7, 22,  T8);
+        MD5_SET_SSE2(MD5_FF, a, b, c, d,  8,  7,  T9);
+        MD5_SET_SSE2(MD5_FF, d, a, b, c,  9, 12, T10);
+        MD5_SET_SSE2(MD5_FF, c, d, a, b, 10, 17, T11);
+        MD5_SET_SSE2(MD5_FF, b, c, d, a, 11, 22, T12);
+        MD5_SET_SSE2(MD5_FF, a, b, c, d, 12,  7, T13);
+        MD5_SET_SSE2(MD5_FF, d, a, b, c, 13, 12, T14);
+        MD5_SET_SSE2(MD5_FF, c, d, a, b, 14, 17, T15);
+        MD5_SET_SSE2(MD5_FF, b, c, d, a, 15, 22, T16);
+
+        /* Round 2. */
+        MD5_SET_SSE2(MD5_GG, a, b, c, d,  1,  5, T17);
+        MD5_SET_SSE2(MD5_GG, d, a, b, c,  6,  9, T18);
+        MD5_SET_SSE2(MD5_GG, c, d, a, b, 11, 14, T19);
+        MD5_SET_SSE2(MD5_GG, b, c, d, a,  0, 20, T20);
+        MD5_SET_SSE2(MD5_GG, a, b, c, d,  5,  5, T21);
+        MD5_SET_SSE2(MD5_GG, d, a, b, c, 10,  9, T22);
+        MD5_SET_SSE2(MD5_GG, c, d, a, b, 15, 14, T23);
+        MD5_SET_SSE2(MD5_GG, b, c, d, a,  4, 20, T24);
+        MD5_SET_SSE2(MD5_GG, a, b, c, d,  9,  5, T25);
+        MD5_SET_SSE2(MD5_GG, d, a, b, c, 14,  9, T26);
+        MD5_SET_SSE2(MD5_GG, c, d, a, b,  3, 14, T27);
+        MD5_SET_SSE2(MD5_GG, b, c, d, a,  8, 20, T28);
+        MD5_SET_SSE2(MD5_GG, a, b, c, d, 13,  5, T29);
+        MD5_SET_SSE2(MD5_GG, d, a, b, c,  2,  9, T30);
+        MD5_SET_SSE2(MD5_GG, c, d, a, b,  7, 14, T31);
+        MD5_SET_SSE2(MD5_GG, b, c, d, a, 12, 20, T32);
+
+        /* Round 3. */
+        MD5_SET_SSE2(MD5_HH, a, b, c, d,  5,  4, T33);
+        MD5_SET_SSE2(MD5_HH, d, a, b, c,  8, 11, T34);
+        MD5_SET_SSE2(MD5_HH, c, d, a, b, 11, 16, T35);
+        MD5_SET_SSE2(MD5_HH, b, c, d, a, 14, 23, T36);
+        MD5_SET_SSE2(MD5_HH, a, b, c, d,  1,  4, T37);
+        MD5_SET_SSE2(MD5_HH, d, a, b, c,  4, 11, T38);
+        MD5_SET_SSE2(MD5_HH, c, d, a, b,  7, 16, T39);
+        MD5_SET_SSE2(MD5_HH, b, c, d, a, 10, 23, T40);
+        MD5_SET_SSE2(MD5_HH, a, b, c, d, 13,  4, T41);
+        MD5_SET_SSE2(MD5_HH, d, a, b, c,  0, 11, T42);
+        MD5_SET_SSE2(MD5_HH, c, d, a, b,  3, 16, T43);
+        MD5_SET_SSE2(MD5_HH, b, c, d, a,  6, 23, T44);
+        MD5_SET_SSE2(MD5_HH, a, b, c, d,  9,  4, T45);
+        MD5_SET_SSE2(MD5_HH, d, a, b, c, 12, 11, T46);
+        MD5_SET_SSE2(MD5_HH, c, d, a, b, 15, 16, T47);
+        MD5_SET_SSE2(MD5_HH, b, c, d, a,  2, 23, T48);
+
+        /* Round 4. */
+        MD5_SET_SSE2(MD5_II, a, b, c, d,  0,  6, T49);
+        MD5_SET_SSE2(MD5_II, d, a, b, c,  7, 10, T50);
+        MD5_SET_SSE2(MD5_II, c, d, a, b, 14, 15, T51);
+        MD5_SET_SSE2(MD5_II, b, c, d, a,  5, 21, T52);
+        MD5_SET_SSE2(MD5_II, a, b, c, d, 12,  6, T53);
+        MD5_SET_SSE2(MD5_II, d, a, b, c,  3, 10, T54);
+        MD5_SET_SSE2(MD5_II, c, d, a, b, 10, 15, T55);
+        MD5_SET_SSE2(MD5_II, b, c, d, a,  1, 21, T56);
+        MD5_SET_SSE2(MD5_II, a, b, c, d,  8,  6, T57);
+        MD5_SET_SSE2(MD5_II, d, a, b, c, 15, 10, T58);
+        MD5_SET_SSE2(MD5_II, c, d, a, b,  6, 15, T59);
+        MD5_SET_SSE2(MD5_II, b, c, d, a, 13, 21, T60);
+        MD5_SET_SSE2(MD5_II, a, b, c, d,  4,  6, T61);
+        MD5_SET_SSE2(MD5_II, d, a, b, c, 11, 10, T62);
+        MD5_SET_SSE2(MD5_II, c, d, a, b,  2, 15, T63);
+        MD5_SET_SSE2(MD5_II, b, c, d, a,  9, 21, T64);
+
+        a = _mm_add_epi32(a, aa);
+        b = _mm_add_epi32(b, bb);
+        c = _mm_add_epi32(c, cc);
+        d = _mm_add_epi32(d, dd);
+    }
+
+    _mm_storeu_si128((__m128i*)state[0], a);
+    _mm_storeu_si128((__m128i*)state[1], b);
+    _mm_storeu_si128((__m128i*)state[2], c);
+    _mm_storeu_si128((__m128i*)state[3], d);
+}
+
+#endif  /* MD5_SSE2 */
+
 void
 MD5::append(const void* data, int nbytes)
 {
@@ -332,6 +527,58 @@ MD5::append(const void* data, int nbytes)
         memcpy(buf, p, left);
 }
 
+void
+MD5::appendMulti(MD5* md5[], const void* data[], const int nbytes[], int count)
+{
+    int nblocks = 0;
+
+#ifdef MD5_SSE2
+    if (count > 1 && count <= MD5_LANES && md5_has_sse2())
+    {
+        nblocks = nbytes[0] / 64;
+        for (int i = 0; i < count; ++i)
+        {
+            if (nbytes[i] / 64 < nblocks)
+                nblocks = nbytes[i] / 64;
+            /* Partial block must be completed first. */
+            if ((md5[i]->count[0] >> 3) & 63)
+                nblocks = 0;
+        }
+    }
+
+    if (nblocks)
+    {
+        /* Unused lanes hash the first message again; the result is dropped. */
+        md5_word_t state[4][MD5_LANES];
+        const md5_byte_t* blocks[MD5_LANES];
+        for (int i = 0; i < MD5_LANES; ++i)
+        {
+            MD5* lane = md5[i < count ? i : 0];
+            blocks[i] = (const md5_byte_t*)data[i < count ? i : 0];
+            for (int j = 0; j < 4; ++j)
+                state[j][i] = lane->abcd[j];
+        }
+
+        md5_process_sse2(state, blocks, nblocks);
+
+        md5_word_t nbits = (md5_word_t)nblocks << 9;
+        for (int i = 0; i < count; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+                md5[i]->abcd[j] = state[j][i];
+            /* Update the message length. */
+            md5[i]->count[1] += nblocks >> 23;
+            md5[i]->count[0] += nbits;
+            if (md5[i]->count[0] < nbits)
+                md5[i]->count[1]++;
+        }
+    }
+#endif  /* MD5_SSE2 */
+
+    for (int i = 0; i < count; ++i)
+        md5[i]->append((const md5_byte_t*)data[i] + 64 * nblocks, nbytes[i] - 64 * nblocks);
+}
+
 void
 MD5::finish()
 {
@@ -373,3 +620,39 @@ const string MD5::getFingerprint()
 	return str;
 }
 
+const string MD5::getState() const
+{
+	md5_byte_t state[sizeof(count) + sizeof(abcd) + sizeof(buf)];
+	memcpy(state, count, sizeof(count));
+	memcpy(state + sizeof(count), abcd, sizeof(abcd));
+	memcpy(state + sizeof(count) + sizeof(abcd), buf, sizeof(buf));
+
+	string str = "";
+	for (size_t i = 0; i < sizeof(state); i++) 
+	{
+		char hex_str[20];
+		_snprintf(hex_str, _countof(hex_str), "%02X", state[i]);
+		str += hex_str;
+	}
+	return str;
+}
+
+bool MD5::setState(const std::string& state_str)
+{
+	md5_byte_t state[sizeof(count) + sizeof(abcd) + sizeof(buf)];
+	if (state_str.size() != 2 * sizeof(state))
+		return false;
+	for (size_t i = 0; i < sizeof(state); i++) 
+	{
+		unsigned int value;
+		if (1 != sscanf(state_str.c_str() + 2 * i, "%2X", &value))
+			return false;
+		state[i] = (md5_byte_t)value;
+	}
+
+	reset();
+	memcpy(count, state, sizeof(count));
+	memcpy(abcd, state + sizeof(count), sizeof(abcd));
+	memcpy(buf, state + sizeof(count) + sizeof(abcd), sizeof(buf));
+	return true;
+}
@@ -37,6 +37,9 @@
 typedef unsigned char md5_byte_t;  // 8-bit byte
 typedef unsigned int md5_word_t;   // 32-bit word
 
+// Number of messages hashed in parallel by MD5::appendMulti()
+#define MD5_LANES 4
+
 class MD5
 {
  public:
@@ -46,6 +49,11 @@ class MD5
     // Append a string to the message.
     void append(const void* data, int nbytes);
 
+    // Append data[i] to md5[i] for count (up to MD5_LANES) messages.
+    // Whole blocks are processed in parallel lanes if SSE2 is supported
+    // by the processor and no message has a partial block accumulated.
+    static void appendMulti(MD5* md5[], const void* data[], const int nbytes[], int count);
+
     // Finish the message.
     void finish();
 
@@ -55,6 +63,13 @@ class MD5
 	// Return string representation of 16-byte fingerprint
 	const std::string getFingerprint();
 
+	// Return hex representation of intermediate state (appended data
+	// which have not been finished), to resume hashing later
+	const std::string getState() const;
+
+	// Restore intermediate state returned by getState()
+	bool setState(const std::string& state);
+
     // Initialize the algorithm. Reset starting values.
     void reset();
 
@@ -72,67 +87,6 @@ class MD5
 
     void
     process(const md5_byte_t data[64]);
-
-    md5_word_t
-    ROTATE_LEFT(const md5_word_t x, const int n);
-
-    md5_word_t
-    F(const md5_word_t x, const md5_word_t y, const md5_word_t z);
-
-    md5_word_t
-    G(const md5_word_t x, const md5_word_t y, const md5_word_t z);
-
-    md5_word_t
-    H(const md5_word_t x, const md5_word_t y, const md5_word_t z);
-
-    md5_word_t
-    I(const md5_word_t x, const md5_word_t y, const md5_word_t z);
-
-    typedef md5_word_t (MD5::*md5func)(const md5_word_t x, const md5_word_t y, const md5_word_t z);
-
-    void
-    SET(md5func func, md5_word_t& a, md5_word_t& b, md5_word_t& c,
-        md5_word_t& d, const int k, const int s,
-        const md5_word_t Ti);
 };
 
-inline md5_word_t
-MD5::ROTATE_LEFT(const md5_word_t x, const int n)
-{
-    return ( (x<<n) | (x>>(32-n)) );
-}
-
-inline md5_word_t
-MD5::F(const md5_word_t x, const md5_word_t y, const md5_word_t z)
-{
-    return ( (x&y) | (~x&z) );
-}
-
-inline md5_word_t
-MD5::G(const md5_word_t x, const md5_word_t y, const md5_word_t z)
-{
-    return ( (x&z) | (y&~z) );
-}
-
-inline md5_word_t
-MD5::H(const md5_word_t x, const md5_word_t y, const md5_word_t z)
-{
-    return ( x^y^z );
-}
-
-inline md5_word_t
-MD5::I(const md5_word_t x, const md5_word_t y, const md5_word_t z)
-{
-    return ( y ^ (x|~z) );
-}
-
-inline void
-MD5::SET(md5func func, md5_word_t& a, md5_word_t& b, md5_word_t& c,
-          md5_word_t& d, const int k, const int s,
-          const md5_word_t Ti)
-{
-    md5_word_t t = a + (this->*func)(b,c,d) + X[k] + Ti;
-    a = ROTATE_LEFT(t, s) + b;
-}
-
 #endif  /* MD5_H */
@@ -0,0 +1,225 @@
+#include <windows.h>
+#include <tchar.h>
+#include <string>
+#include <list>
+#include <map>
+using namespace std;
+
+#include "engine/ratelimiter.h"
+#include "curl/curl.h"
+
+// Buckets are refilled not more often than this period, msec
+#define RATE_REFILL_PERIOD 50
+
+// Bucket capacity: bandwidth for this period, msec,
+// but not less than one cURL write chunk
+#define RATE_BURST_PERIOD 250
+#define RATE_MIN_BURST CURL_MAX_WRITE_SIZE
+
+static double GetCapacity(unsigned long long rate)
+{
+	double capacity = (double)rate * RATE_BURST_PERIOD / 1000;
+	return (capacity < RATE_MIN_BURST) ? RATE_MIN_BURST : capacity;
+}
+
+RateLimiter::RateLimiter()
+{
+	InitLock(&lock_);
+	global_.rate_ = 0;
+	global_.tokens_ = 0;
+	global_.own_limit_ = true;
+	default_file_rate_ = 0;
+	default_host_rate_ = 0;
+	refill_start_ = GetTickCount();
+}
+
+RateLimiter::~RateLimiter()
+{
+	CloseLock(&lock_);
+}
+
+void RateLimiter::SetRate(Bucket& bucket, unsigned long long rate)
+{
+	bucket.rate_ = rate;
+	double capacity = GetCapacity(rate);
+	if (bucket.tokens_ > capacity)
+		bucket.tokens_ = capacity;
+}
+
+void RateLimiter::Refill(Bucket& bucket, DWORD elapsed)
+{
+	if (0 == bucket.rate_)
+		return;
+	bucket.tokens_ += (double)bucket.rate_ * elapsed / 1000;
+	double capacity = GetCapacity(bucket.rate_);
+	if (bucket.tokens_ > capacity)
+		bucket.tokens_ = capacity;
+}
+
+void RateLimiter::SetGlobalLimit(unsigned long long rate)
+{
+	Lock(&lock_);
+	SetRate(global_, rate);
+	Unlock(&lock_);
+}
+
+void RateLimiter::SetDefaultFileLimit(unsigned long long rate)
+{
+	Lock(&lock_);
+	default_file_rate_ = rate;
+	for (BucketMap::iterator iter = files_.begin(); iter != files_.end(); iter++)
+		if (!iter->second.own_limit_)
+			SetRate(iter->second, rate);
+	Unlock(&lock_);
+}
+
+void RateLimiter::SetDefaultHostLimit(unsigned long long rate)
+{
+	Lock(&lock_);
+	default_host_rate_ = rate;
+	for (BucketMap::iterator iter = hosts_.begin(); iter != hosts_.end(); iter++)
+		if (!iter->second.own_limit_)
+			SetRate(iter->second, rate);
+	Unlock(&lock_);
+}
+
+void RateLimiter::SetFileLimit(const std::string& file_key, unsigned long long rate)
+{
+	Lock(&lock_);
+	Bucket& bucket = GetBucket(files_, file_key, default_file_rate_);
+	bucket.own_limit_ = true;
+	SetRate(bucket, rate);
+	Unlock(&lock_);
+}
+
+void RateLimiter::SetHostLimit(const std::string& host_key, unsigned long long rate)
+{
+	Lock(&lock_);
+	Bucket& bucket = GetBucket(hosts_, host_key, default_host_rate_);
+	bucket.own_limit_ = true;
+	SetRate(bucket, rate);
+	Unlock(&lock_);
+}
+
+RateLimiter::Bucket& RateLimiter::GetBucket(BucketMap& buckets, const std::string& key,
+											unsigned long long default_rate)
+{
+	BucketMap::iterator iter = buckets.find(key);
+	if (iter != buckets.end())
+		return iter->second;
+
+	Bucket bucket;
+	bucket.rate_ = default_rate;
+	bucket.tokens_ = GetCapacity(default_rate);
+	bucket.own_limit_ = false;
+	return buckets.insert(make_pair(key, bucket)).first->second;
+}
+
+bool RateLimiter::HasTokens(const std::string& file_key, const std::string& host_key)
+{
+	Bucket& file = GetBucket(files_, file_key, default_file_rate_);
+	Bucket& host = GetBucket(hosts_, host_key, default_host_rate_);
+	return (0 == global_.rate_ || global_.tokens_ > 0)
+		&& (0 == file.rate_ || file.tokens_ > 0)
+		&& (0 == host.rate_ || host.tokens_ > 0);
+}
+
+bool RateLimiter::Acquire(RateLimited *conn, const std::string& file_key, const std::string& host_key)
+{
+	// Buckets are refilled in Tick() only, and paused connections are 
+	// resumed there first. Afterwards a running connection may take tokens
+	// left while others wait for another (empty) bucket; the queue is not 
+	// enforced, so such waiters do not block connections of other files.
+	Lock(&lock_);
+	bool ret_val = HasTokens(file_key, host_key);
+	if (!ret_val)
+	{
+		Waiter waiter;
+		waiter.conn_ = conn;
+		waiter.file_key_ = file_key;
+		waiter.host_key_ = host_key;
+		waiters_.push_back(waiter);
+	}
+	Unlock(&lock_);
+	return ret_val;
+}
+
+void RateLimiter::Consume(const std::string& file_key, const std::string& host_key, size_t size)
+{
+	Lock(&lock_);
+	Bucket& file = GetBucket(files_, file_key, default_file_rate_);
+	Bucket& host = GetBucket(hosts_, host_key, default_host_rate_);
+	if (global_.rate_)
+		global_.tokens_ -= size;
+	if (file.rate_)
+		file.tokens_ -= size;
+	if (host.rate_)
+		host.tokens_ -= size;
+	Unlock(&lock_);
+}
+
+void RateLimiter::Cancel(RateLimited *conn)
+{
+	Lock(&lock_);
+	for (list<Waiter>::iterator iter = waiters_.begin(); iter != waiters_.end(); )
+	{
+		if (iter->conn_ == conn)
+			iter = waiters_.erase(iter);
+		else
+			iter++;
+	}
+	Unlock(&lock_);
+}
+
+void RateLimiter::RemoveFile(const std::string& file_key)
+{
+	Lock(&lock_);
+	BucketMap::iterator iter = files_.find(file_key);
+	if (iter != files_.end() && !iter->second.own_limit_)
+		files_.erase(iter);
+	Unlock(&lock_);
+}
+
+void RateLimiter::Tick()
+{
+	list<Waiter> waiters, kept;
+
+	Lock(&lock_);
+	DWORD elapsed = GetTickCount() - refill_start_;
+	if (elapsed < RATE_REFILL_PERIOD)
+	{
+		Unlock(&lock_);
+		return;
+	}
+	refill_start_ += elapsed;
+	Refill(global_, elapsed);
+	BucketMap::iterator iter;
+	for (iter = files_.begin(); iter != files_.end(); iter++)
+		Refill(iter->second, elapsed);
+	for (iter = hosts_.begin(); iter != hosts_.end(); iter++)
+		Refill(iter->second, elapsed);
+	waiters.swap(waiters_);
+	Unlock(&lock_);
+
+	// Resume connections in the order they have been paused. Resume() is
+	// called without lock_: resumed connection consumes tokens at once.
+	while (!waiters.empty())
+	{
+		Waiter waiter = waiters.front();
+		waiters.pop_front();
+
+		Lock(&lock_);
+		bool has_tokens = HasTokens(waiter.file_key_, waiter.host_key_);
+		if (!has_tokens)
+			kept.push_back(waiter);
+		Unlock(&lock_);
+
+		if (has_tokens)
+			waiter.conn_->Resume();
+	}
+
+	// Connections which are still waiting go before the ones paused just now
+	Lock(&lock_);
+	waiters_.splice(waiters_.begin(), kept);
+	Unlock(&lock_);
+}
@@ -0,0 +1,107 @@
+#ifndef _RATELIMITER_H_
+#define _RATELIMITER_H_
+
+#include "common/types.h"
+#include <list>
+#include <map>
+
+/**
+ *	Connection throttled by RateLimiter.
+ */
+class RateLimited
+{
+public:
+	virtual ~RateLimited() {}
+
+	/**
+	 *	Called from RateLimiter::Tick() when bandwidth is available for
+	 *	the connection which has been refused by RateLimiter::Acquire().
+	 */
+	virtual void Resume() = 0;
+};
+
+/**
+ *	Token bucket bandwidth limiter with global, per-file and per-host caps.
+ *	Connections which exceed any cap are paused and resumed in FIFO order
+ *	when buckets are refilled, so the budget is shared fairly by connections.
+ *	Limits can be changed at any time from any thread; the rest of methods
+ *	are called from engine thread.
+ */
+class RateLimiter
+{
+public:
+	RateLimiter();
+
+	virtual ~RateLimiter();
+
+	/**
+	 *	Limits are set in bytes/sec; 0 means no limit. Default limits are
+	 *	applied to files and hosts which have no limit of their own.
+	 */
+	void SetGlobalLimit(unsigned long long rate);
+	void SetDefaultFileLimit(unsigned long long rate);
+	void SetDefaultHostLimit(unsigned long long rate);
+	void SetFileLimit(const std::string& file_key, unsigned long long rate);
+	void SetHostLimit(const std::string& host_key, unsigned long long rate);
+
+	/**
+	 *	Ask for bandwidth before received data are accepted. Buckets may be
+	 *	overdrawn, so data are accepted while all buckets are not empty.
+	 *	@return false if connection must be paused; Resume() is called later
+	 */
+	bool Acquire(RateLimited *conn, const std::string& file_key, const std::string& host_key);
+
+	/**
+	 *	Take size bytes from all buckets of the connection.
+	 */
+	void Consume(const std::string& file_key, const std::string& host_key, size_t size);
+
+	/**
+	 *	Forget paused connection. Must be called before connection is freed.
+	 */
+	void Cancel(RateLimited *conn);
+
+	/**
+	 *	Forget bucket of the file which is not downloaded anymore, unless
+	 *	the file has a limit of its own.
+	 */
+	void RemoveFile(const std::string& file_key);
+
+	/**
+	 *	Refill buckets and resume paused connections. Called periodically.
+	 */
+	void Tick();
+
+private:
+	struct Bucket {
+		unsigned long long rate_; // bytes/sec, 0 if not limited
+		double tokens_;
+		bool own_limit_;          // Limit is not taken from default one
+	};
+	typedef std::map<std::string, Bucket> BucketMap;
+
+	struct Waiter {
+		RateLimited *conn_;
+		std::string file_key_;
+		std::string host_key_;
+	};
+
+	lock_t lock_;
+
+	// Members below: lock_ MUST be held when accessing them
+	Bucket global_;
+	BucketMap files_;
+	BucketMap hosts_;
+	unsigned long long default_file_rate_;
+	unsigned long long default_host_rate_;
+	std::list<Waiter> waiters_;
+	DWORD refill_start_;
+
+	Bucket& GetBucket(BucketMap& buckets, const std::string& key, unsigned long long default_rate);
+	bool HasTokens(const std::string& file_key, const std::string& host_key);
+
+	static void SetRate(Bucket& bucket, unsigned long long rate);
+	static void Refill(Bucket& bucket, DWORD elapsed);
+};
+
+#endif
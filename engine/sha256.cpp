@@ -0,0 +1,219 @@
+#include <windows.h>
+#include <tchar.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+using namespace std;
+
+#include "engine/sha256.h"
+
+/*
+ * Compile with -DSHA256_TEST to create a self-contained test program.
+ * It should print out the values given in FIPS 180-2, appendix B.
+ */
+
+#ifdef SHA256_TEST
+
+int main()
+{
+	static const char *const test[3] = {
+		"abc", /*BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD*/
+		"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+			/*248D6A61D20638B8E5C026930C3E6039A33CE45964FF2167F6ECEDD419DB06C1*/
+		"" /*E3B0C44298FC1C149AFBF4C8996FB92427AE41E4649B934CA495991B7852B855*/
+	};
+
+	for (int i = 0; i < 3; i++)
+	{
+		SHA256 sha;
+		sha.append(test[i], (int)strlen(test[i]));
+		sha.finish();
+		printf("SHA256 (\"%s\") = %s\n", test[i], sha.getFingerprint().c_str());
+	}
+	return 0;
+}
+#endif  /* SHA256_TEST */
+
+static const sha256_word_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define SIGMA0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIGMA1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define GAMMA0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define GAMMA1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+SHA256::SHA256()
+{
+	reset();
+}
+
+void SHA256::reset()
+{
+	count[0] = count[1] = 0;
+	h[0] = 0x6a09e667;
+	h[1] = 0xbb67ae85;
+	h[2] = 0x3c6ef372;
+	h[3] = 0xa54ff53a;
+	h[4] = 0x510e527f;
+	h[5] = 0x9b05688c;
+	h[6] = 0x1f83d9ab;
+	h[7] = 0x5be0cd19;
+	memset(digest, 0, sizeof(digest));
+	memset(buf, 0, sizeof(buf));
+}
+
+void SHA256::process(const sha256_byte_t data[64])
+{
+	sha256_word_t w[64];
+	int i;
+
+	// Message words are big-endian
+	for (i = 0; i < 16; i++)
+		w[i] = ((sha256_word_t)data[4 * i] << 24) | ((sha256_word_t)data[4 * i + 1] << 16) 
+			| ((sha256_word_t)data[4 * i + 2] << 8) | (sha256_word_t)data[4 * i + 3];
+	for (; i < 64; i++)
+		w[i] = GAMMA1(w[i - 2]) + w[i - 7] + GAMMA0(w[i - 15]) + w[i - 16];
+
+	sha256_word_t a = h[0], b = h[1], c = h[2], d = h[3];
+	sha256_word_t e = h[4], f = h[5], g = h[6], hh = h[7];
+	for (i = 0; i < 64; i++)
+	{
+		sha256_word_t t1 = hh + SIGMA1(e) + CH(e, f, g) + K[i] + w[i];
+		sha256_word_t t2 = SIGMA0(a) + MAJ(a, b, c);
+		hh = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+	h[5] += f;
+	h[6] += g;
+	h[7] += hh;
+}
+
+void SHA256::append(const void* data, int nbytes)
+{
+	const sha256_byte_t* p = (const sha256_byte_t*)data;
+	int left = nbytes;
+	int offset = (count[0] >> 3) & 63;
+	sha256_word_t nbits = (sha256_word_t)nbytes << 3;
+
+	if (nbytes <= 0)
+		return;
+
+	// Update the message length
+	count[1] += nbytes >> 29;
+	count[0] += nbits;
+	if (count[0] < nbits)
+		count[1]++;
+
+	// Process an initial partial block
+	if (offset)
+	{
+		int copy = (offset + nbytes > 64) ? (64 - offset) : nbytes;
+		memcpy(buf + offset, p, copy);
+		if (offset + copy < 64)
+			return;
+		p += copy;
+		left -= copy;
+		process(buf);
+	}
+
+	// Process full blocks
+	for (; left >= 64; p += 64, left -= 64)
+		process(p);
+
+	// Process a final partial block
+	if (left)
+		memcpy(buf, p, left);
+}
+
+void SHA256::finish()
+{
+	static const sha256_byte_t pad[64] = { 0x80 };
+	sha256_byte_t data[8];
+	int i;
+	// Save the length before padding; big-endian
+	for (i = 0; i < 8; i++)
+		data[i] = (sha256_byte_t)(count[(7 - i) >> 2] >> (((7 - i) & 3) << 3));
+	// Pad to 56 bytes mod 64
+	append(pad, ((55 - (count[0] >> 3)) & 63) + 1);
+	// Append the length
+	append(data, 8);
+	for (i = 0; i < 32; i++)
+		digest[i] = (sha256_byte_t)(h[i >> 2] >> ((3 - (i & 3)) << 3));
+}
+
+const sha256_byte_t* SHA256::getDigest()
+{
+	return digest;
+}
+
+const string SHA256::getFingerprint()
+{
+	string str = "";
+	for (int i = 0; i < 32; i++) 
+	{
+		char hex_str[20];
+		_snprintf(hex_str, _countof(hex_str), "%02X", digest[i]);
+		str += hex_str;
+	}
+	return str;
+}
+
+const string SHA256::getState() const
+{
+	sha256_byte_t state[sizeof(count) + sizeof(h) + sizeof(buf)];
+	memcpy(state, count, sizeof(count));
+	memcpy(state + sizeof(count), h, sizeof(h));
+	memcpy(state + sizeof(count) + sizeof(h), buf, sizeof(buf));
+
+	string str = "";
+	for (size_t i = 0; i < sizeof(state); i++) 
+	{
+		char hex_str[20];
+		_snprintf(hex_str, _countof(hex_str), "%02X", state[i]);
+		str += hex_str;
+	}
+	return str;
+}
+
+bool SHA256::setState(const std::string& state_str)
+{
+	sha256_byte_t state[sizeof(count) + sizeof(h) + sizeof(buf)];
+	if (state_str.size() != 2 * sizeof(state))
+		return false;
+	for (size_t i = 0; i < sizeof(state); i++) 
+	{
+		unsigned int value;
+		if (1 != sscanf(state_str.c_str() + 2 * i, "%2X", &value))
+			return false;
+		state[i] = (sha256_byte_t)value;
+	}
+
+	reset();
+	memcpy(count, state, sizeof(count));
+	memcpy(h, state + sizeof(count), sizeof(h));
+	memcpy(buf, state + sizeof(count) + sizeof(h), sizeof(buf));
+	return true;
+}
@@ -0,0 +1,47 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include "common/types.h"
+
+typedef unsigned char sha256_byte_t;  // 8-bit byte
+typedef unsigned int sha256_word_t;   // 32-bit word
+
+/**
+ *	SHA-256 (FIPS 180-2). Interface follows MD5 class.
+ */
+class SHA256
+{
+public:
+	SHA256();
+
+	// Initialize the algorithm. Reset starting values.
+	void reset();
+
+	// Append a string to the message.
+	void append(const void* data, int nbytes);
+
+	// Finish the message.
+	void finish();
+
+	// Return pointer to 32-byte digest.
+	const sha256_byte_t* getDigest();
+
+	// Return string representation of 32-byte digest
+	const std::string getFingerprint();
+
+	// Return hex representation of intermediate state, to resume hashing later
+	const std::string getState() const;
+
+	// Restore intermediate state returned by getState()
+	bool setState(const std::string& state);
+
+private:
+	sha256_word_t count[2];  // Message length in bits, lsw first
+	sha256_word_t h[8];      // Digest buffer
+	sha256_byte_t buf[64];   // Accumulate block
+	sha256_byte_t digest[32];
+
+	void process(const sha256_byte_t data[64]);
+};
+
+#endif
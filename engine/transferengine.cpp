@@ -0,0 +1,425 @@
+// Default FD_SETSIZE (64) is too small for hundreds of concurrent ranges.
+// Must be defined before any Winsock header is included.
+#define FD_SETSIZE 1024
+
+#include <windows.h>
+#include <tchar.h>
+#include <process.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <algorithm>
+using namespace std;
+
+#include "engine/transferengine.h"
+#include "common/logging.h"
+
+// Maximum time between two Transfer::OnTick() calls, msec
+#define ENGINE_TICK_PERIOD 100
+
+TransferEngine::TransferEngine()
+{
+	InitLock(&lock_);
+	multi_handle_ = NULL;
+	thread_handle_ = NULL;
+	thread_id_ = 0;
+	wakeup_socket_ = CURL_SOCKET_BAD;
+	timeout_ = -1;
+	timeout_start_ = 0;
+	exit_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+	wakeup_event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+	removed_event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+TransferEngine::~TransferEngine()
+{
+	Stop();
+	if (exit_event_)
+		CloseHandle(exit_event_);
+	if (wakeup_event_)
+		CloseHandle(wakeup_event_);
+	if (removed_event_)
+		CloseHandle(removed_event_);
+	CloseLock(&lock_);
+}
+
+/**
+ *	Create curl_multi and launch engine thread.
+ *	NOTE: curl_global_init() must be issued prior calling this routine.
+ */
+bool TransferEngine::Start()
+{
+	if (!exit_event_ || !wakeup_event_ || !removed_event_)
+		return false;
+
+	multi_handle_ = curl_multi_init();
+	if (!multi_handle_)
+		return false;
+
+	curl_multi_setopt(multi_handle_, CURLMOPT_SOCKETFUNCTION, SocketCallback);
+	curl_multi_setopt(multi_handle_, CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(multi_handle_, CURLMOPT_TIMERFUNCTION, TimerCallback);
+	curl_multi_setopt(multi_handle_, CURLMOPT_TIMERDATA, this);
+
+	// Not fatal: queued transfers are picked up on the next tick then
+	if (!CreateWakeupSocket())
+		LOG(("[TransferEngine::Start] Wakeup socket is not created, error %u\n", WSAGetLastError()));
+
+	unsigned thread_id;
+	thread_handle_ = (HANDLE)_beginthreadex(NULL, 0, EngineThread, this, 0, &thread_id);
+	if (!thread_handle_)
+	{
+		curl_multi_cleanup(multi_handle_);
+		multi_handle_ = NULL;
+		if (CURL_SOCKET_BAD != wakeup_socket_)
+		{
+			closesocket(wakeup_socket_);
+			wakeup_socket_ = CURL_SOCKET_BAD;
+		}
+		return false;
+	}
+	thread_id_ = thread_id;
+
+	return true;
+}
+
+void TransferEngine::Stop()
+{
+	if (!thread_handle_)
+		return;
+
+	SetEvent(exit_event_);
+	WaitForSingleObject(thread_handle_, INFINITE);
+	CloseHandle(thread_handle_);
+	thread_handle_ = NULL;
+
+	curl_multi_cleanup(multi_handle_);
+	multi_handle_ = NULL;
+
+	if (CURL_SOCKET_BAD != wakeup_socket_)
+	{
+		closesocket(wakeup_socket_);
+		wakeup_socket_ = CURL_SOCKET_BAD;
+	}
+}
+
+/**
+ *	Winsock has no socketpair(); UDP socket bound to loopback 
+ *	and connected to its own address is used instead.
+ */
+bool TransferEngine::CreateWakeupSocket()
+{
+	wakeup_socket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (CURL_SOCKET_BAD == wakeup_socket_)
+		return false;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	int addr_len = sizeof(addr);
+	u_long non_blocking = 1;
+	if (SOCKET_ERROR == bind(wakeup_socket_, (struct sockaddr*)&addr, sizeof(addr))
+		|| SOCKET_ERROR == getsockname(wakeup_socket_, (struct sockaddr*)&addr, &addr_len)
+		|| SOCKET_ERROR == connect(wakeup_socket_, (struct sockaddr*)&addr, sizeof(addr))
+		|| SOCKET_ERROR == ioctlsocket(wakeup_socket_, FIONBIO, &non_blocking))
+	{
+		closesocket(wakeup_socket_);
+		wakeup_socket_ = CURL_SOCKET_BAD;
+		return false;
+	}
+	return true;
+}
+
+void TransferEngine::Wakeup()
+{
+	SetEvent(wakeup_event_);
+	// Send fails if previous wakeups have not been read yet; one is enough
+	if (CURL_SOCKET_BAD != wakeup_socket_)
+	{
+		char data = 0;
+		send(wakeup_socket_, &data, 1, 0);
+	}
+}
+
+void TransferEngine::Add(Transfer *transfer)
+{
+	Lock(&lock_);
+	pending_add_.push_back(transfer);
+	Unlock(&lock_);
+	Wakeup();
+}
+
+void TransferEngine::Remove(Transfer *transfer)
+{
+	if (GetCurrentThreadId() == thread_id_)
+	{
+		// Called from one of transfer callbacks; detach immediately
+		Lock(&lock_);
+		pending_add_.remove(transfer);
+		Unlock(&lock_);
+		Detach(transfer);
+		return;
+	}
+
+	Lock(&lock_);
+	pending_remove_.push_back(transfer);
+	Unlock(&lock_);
+	Wakeup();
+
+	for ( ; ; )
+	{
+		Lock(&lock_);
+		bool pending =
+			(pending_remove_.end() != find(pending_remove_.begin(), pending_remove_.end(), transfer));
+		Unlock(&lock_);
+		if (!pending || WAIT_OBJECT_0 != WaitForSingleObject(thread_handle_, 0))
+			break;
+		WaitForSingleObject(removed_event_, ENGINE_TICK_PERIOD);
+	}
+}
+
+void TransferEngine::Detach(Transfer *transfer)
+{
+	list<Transfer *>::iterator iter = find(active_.begin(), active_.end(), transfer);
+	if (iter == active_.end())
+		return;
+	active_.erase(iter);
+	curl_multi_remove_handle(multi_handle_, transfer->GetHttpHandle());
+}
+
+bool TransferEngine::IsActive(Transfer *transfer)
+{
+	return active_.end() != find(active_.begin(), active_.end(), transfer);
+}
+
+void TransferEngine::SocketAction(curl_socket_t s, int ev_bitmask)
+{
+	int running;
+	while (CURLM_CALL_MULTI_PERFORM ==
+		curl_multi_socket_action(multi_handle_, s, ev_bitmask, &running))
+		;
+}
+
+/**
+ *	Attach queued transfers to curl_multi and detach queued removals.
+ *	Transfer callbacks are never called while lock_ is held.
+ */
+void TransferEngine::ProcessPending()
+{
+	list<Transfer *> to_add, to_remove;
+
+	Lock(&lock_);
+	to_add.swap(pending_add_);
+	to_remove.assign(pending_remove_.begin(), pending_remove_.end());
+	Unlock(&lock_);
+
+	for (list<Transfer *>::iterator iter = to_remove.begin(); iter != to_remove.end(); iter++)
+	{
+		to_add.remove(*iter);
+		Detach(*iter);
+	}
+
+	if (!to_remove.empty())
+	{
+		Lock(&lock_);
+		for (list<Transfer *>::iterator iter = to_remove.begin(); iter != to_remove.end(); iter++)
+			pending_remove_.remove(*iter);
+		Unlock(&lock_);
+		SetEvent(removed_event_);
+	}
+
+	for (list<Transfer *>::iterator iter = to_add.begin(); iter != to_add.end(); iter++)
+	{
+		Transfer *transfer = *iter;
+		CURL *http_handle = transfer->GetHttpHandle();
+		curl_easy_setopt(http_handle, CURLOPT_PRIVATE, transfer);
+		if (CURLM_OK != curl_multi_add_handle(multi_handle_, http_handle))
+		{
+			LOG(("[TransferEngine::ProcessPending] ERROR: could not add handle 0x%p\n", http_handle));
+			transfer->OnDone(CURLE_FAILED_INIT);
+			continue;
+		}
+		active_.push_back(transfer);
+	}
+}
+
+/**
+ *	Wait for socket readiness (or cURL timer expiration) and let cURL
+ *	process the sockets which are ready. Wait is broken by Add()/Remove().
+ */
+void TransferEngine::Poll()
+{
+	DWORD wait_time = ENGINE_TICK_PERIOD;
+	if (timeout_ >= 0)
+	{
+		DWORD elapsed = GetTickCount() - timeout_start_;
+		if (elapsed >= (DWORD)timeout_)
+			wait_time = 0;
+		else if ((DWORD)timeout_ - elapsed < wait_time)
+			wait_time = (DWORD)timeout_ - elapsed;
+	}
+
+	if (sockets_.empty() && CURL_SOCKET_BAD == wakeup_socket_)
+	{
+		// select() fails on empty sets
+		WaitForSingleObject(wakeup_event_, wait_time);
+	}
+	else
+	{
+		fd_set read_set, write_set, error_set;
+		FD_ZERO(&read_set);
+		FD_ZERO(&write_set);
+		FD_ZERO(&error_set);
+		map<curl_socket_t, int>::iterator iter;
+		for (iter = sockets_.begin(); iter != sockets_.end(); iter++)
+		{
+			if (iter->second & CURL_POLL_IN)
+				FD_SET(iter->first, &read_set);
+			if (iter->second & CURL_POLL_OUT)
+				FD_SET(iter->first, &write_set);
+			FD_SET(iter->first, &error_set);
+		}
+		if (CURL_SOCKET_BAD != wakeup_socket_)
+			FD_SET(wakeup_socket_, &read_set);
+
+		struct timeval tv;
+		tv.tv_sec = wait_time / 1000;
+		tv.tv_usec = (wait_time % 1000) * 1000;
+		int nr_ready = select(0, &read_set, &write_set, &error_set, &tv);
+		if (nr_ready > 0)
+		{
+			if (CURL_SOCKET_BAD != wakeup_socket_ && FD_ISSET(wakeup_socket_, &read_set))
+			{
+				// Queued transfers are processed by the next ProcessPending()
+				char data[16];
+				while (recv(wakeup_socket_, data, sizeof(data), 0) > 0)
+					;
+			}
+			// Socket map is modified from SocketCallback; collect ready sockets first
+			vector< pair<curl_socket_t, int> > ready;
+			for (iter = sockets_.begin(); iter != sockets_.end(); iter++)
+			{
+				int ev_bitmask = 0;
+				if (FD_ISSET(iter->first, &read_set))
+					ev_bitmask |= CURL_CSELECT_IN;
+				if (FD_ISSET(iter->first, &write_set))
+					ev_bitmask |= CURL_CSELECT_OUT;
+				if (FD_ISSET(iter->first, &error_set))
+					ev_bitmask |= CURL_CSELECT_ERR;
+				if (ev_bitmask)
+					ready.push_back(make_pair(iter->first, ev_bitmask));
+			}
+			for (size_t i = 0; i < ready.size(); i++)
+				SocketAction(ready[i].first, ready[i].second);
+		}
+		else if (nr_ready < 0)
+		{
+			LOG(("[TransferEngine::Poll] ERROR: select() failed\n"));
+			Sleep(wait_time);
+		}
+	}
+
+	if (timeout_ >= 0 && GetTickCount() - timeout_start_ >= (DWORD)timeout_)
+	{
+		timeout_ = -1;
+		SocketAction(CURL_SOCKET_TIMEOUT, 0);
+		// Timer callback is not called if the earliest expiry has not changed;
+		// pending timers (resolve, connect timeout, paused handles) are kept
+		if (timeout_ < 0)
+		{
+			long timeout_ms = -1;
+			if (CURLM_OK == curl_multi_timeout(multi_handle_, &timeout_ms) && timeout_ms >= 0)
+			{
+				timeout_ = timeout_ms;
+				timeout_start_ = GetTickCount();
+			}
+		}
+	}
+}
+
+void TransferEngine::ProcessMessages()
+{
+	CURLMsg *msg;
+	int nr_msgs;
+	while (NULL != (msg = curl_multi_info_read(multi_handle_, &nr_msgs)))
+	{
+		if (CURLMSG_DONE != msg->msg)
+			continue;
+		Transfer *transfer = NULL;
+		CURLcode result = msg->data.result;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+		if (!transfer || !IsActive(transfer))
+			continue;
+		Detach(transfer);
+		transfer->OnDone(result);
+	}
+}
+
+void TransferEngine::Tick()
+{
+	// Transfers can be detached from OnTick()/OnDone() of other transfers
+	list<Transfer *> transfers(active_.begin(), active_.end());
+	for (list<Transfer *>::iterator iter = transfers.begin(); iter != transfers.end(); iter++)
+	{
+		Transfer *transfer = *iter;
+		if (!IsActive(transfer))
+			continue;
+		if (!transfer->OnTick())
+		{
+			Detach(transfer);
+			transfer->OnDone(CURLE_ABORTED_BY_CALLBACK);
+		}
+	}
+}
+
+unsigned __stdcall TransferEngine::EngineThread(void *arg)
+{
+	TransferEngine *engine = (TransferEngine*)arg;
+
+	// Retry jitter of segments is taken from rand() of this thread; CRT seed 
+	// is per thread and the same in every process unless it is set
+	srand(GetTickCount() ^ GetCurrentThreadId());
+
+	DWORD last_tick = GetTickCount();
+	while (WAIT_OBJECT_0 != WaitForSingleObject(engine->exit_event_, 0))
+	{
+		engine->ProcessPending();
+		engine->Poll();
+		engine->ProcessMessages();
+		if (GetTickCount() - last_tick >= ENGINE_TICK_PERIOD)
+		{
+			last_tick = GetTickCount();
+			engine->Tick();
+		}
+	}
+
+	// Detach everything left; owners are responsible for their transfers
+	while (!engine->active_.empty())
+		engine->Detach(engine->active_.front());
+
+	_endthreadex(0);
+	return 0;
+}
+
+int TransferEngine::SocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+	TransferEngine *engine = (TransferEngine*)userp;
+	if (CURL_POLL_REMOVE == what)
+		engine->sockets_.erase(s);
+	else
+		engine->sockets_[s] = what;
+	return 0;
+}
+
+int TransferEngine::TimerCallback(CURLM *multi, long timeout_ms, void *userp)
+{
+	TransferEngine *engine = (TransferEngine*)userp;
+	engine->timeout_ = timeout_ms;
+	engine->timeout_start_ = GetTickCount();
+	return 0;
+}
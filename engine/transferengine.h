@@ -0,0 +1,108 @@
+#ifndef _TRANSFERENGINE_H_
+#define _TRANSFERENGINE_H_
+
+#include "common/types.h"
+#include <list>
+#include <map>
+#include "curl/curl.h"
+
+/**
+ *	Single HTTP transfer driven by TransferEngine.
+ *	All methods are called from the engine thread.
+ */
+class Transfer
+{
+public:
+	virtual ~Transfer() {}
+
+	/**
+	 *	cURL easy handle of this transfer. Handle must be fully configured
+	 *	before the transfer is added to the engine.
+	 */
+	virtual CURL *GetHttpHandle() = 0;
+
+	/**
+	 *	Called periodically while transfer is active (even if it is paused).
+	 *	@return false to abort transfer; OnDone() is called in this case
+	 */
+	virtual bool OnTick() = 0;
+
+	/**
+	 *	Called when transfer is finished. Easy handle is already detached
+	 *	from the engine, so it can be cleaned up or re-added.
+	 */
+	virtual void OnDone(CURLcode result) = 0;
+};
+
+/**
+ *	Event-driven transfer engine. Drives all transfers as easy handles
+ *	of one curl_multi from a single thread using socket readiness callbacks.
+ */
+class TransferEngine
+{
+public:
+	TransferEngine();
+
+	virtual ~TransferEngine();
+
+	bool Start();
+
+	void Stop();
+
+	/**
+	 *	Add transfer to engine. Thread-safe.
+	 */
+	void Add(Transfer *transfer);
+
+	/**
+	 *	Detach transfer from engine without OnDone() notification. Thread-safe.
+	 *	Returns when transfer is detached, so it can be freed by caller.
+	 */
+	void Remove(Transfer *transfer);
+
+private:
+	lock_t lock_;
+
+	CURLM *multi_handle_;
+
+	HANDLE thread_handle_;
+	DWORD thread_id_;
+
+	HANDLE exit_event_;
+	HANDLE wakeup_event_;  // Set when new transfers are queued
+	HANDLE removed_event_; // Set by engine thread when queued removals are processed
+
+	// Loopback socket connected to itself; select() returns when a byte is 
+	// sent to it. CURL_SOCKET_BAD if it has not been created (wakeup_event_ 
+	// is waited for then, only while there are no sockets of transfers).
+	curl_socket_t wakeup_socket_;
+
+	std::list<Transfer *> pending_add_;    // lock_ MUST be held when accessing this member
+	std::list<Transfer *> pending_remove_; // lock_ MUST be held when accessing this member
+
+	// Members below are accessed from engine thread only
+	std::list<Transfer *> active_;
+	std::map<curl_socket_t, int> sockets_; // socket -> CURL_POLL_XXX
+	long timeout_;                         // Timeout requested by cURL, msec (-1 if none)
+	DWORD timeout_start_;
+
+	static unsigned __stdcall EngineThread(void *arg);
+
+	bool CreateWakeupSocket();
+	void Wakeup();
+
+	void ProcessPending();
+	void Poll();
+	void ProcessMessages();
+	void Tick();
+
+	void Detach(Transfer *transfer);
+	bool IsActive(Transfer *transfer);
+	void SocketAction(curl_socket_t s, int ev_bitmask);
+
+	// CURL callbacks
+	static int SocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp);
+	static int TimerCallback(CURLM *multi, long timeout_ms, void *userp);
+};
+
+#endif
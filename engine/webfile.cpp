@@ -1,52 +1,139 @@
 #include <windows.h>
 #include <tchar.h>
 #include <assert.h>
+#include <float.h>
+#include <string.h>
 #include <process.h>
 #include <string>
 #include <vector>
+#include <algorithm>
 using namespace std;
 
 #include "engine/webfile.h"
 #include "engine/webfilesegment.h"
+#include "engine/transferengine.h"
+#include "engine/diskwriter.h"
+#include "engine/ratelimiter.h"
 #include "common/consts.h"
 #include "common/misc.h"
 #include "common/logging.h"
 
-WebFile::WebFile(const std::string& url, const StlString& fname, 
+// Mirror throughput is sampled with this period, msec
+#define MIRROR_SAMPLE_PERIOD 1000
+
+// Failed mirror is not used for this period; the period is doubled 
+// for every error in a row, msec
+#define MIRROR_DEMOTE_PERIOD 5000
+#define MIRROR_MAX_DEMOTE_SHIFT 5
+
+// Pending disk writes are polled with this period when file is closed, msec
+#define WRITE_WAIT_PERIOD 10
+
+// View of file mapping which is moved along with segment position. Views 
+// start at multiples of allocation granularity.
+#define MAP_VIEW_SIZE      (8 * 1024 * 1024)
+#define MAP_VIEW_ALIGNMENT 0x10000
+
+// Ranges waiting for retry are checked with this period, msec
+#define RETRY_CHECK_PERIOD 100
+
+// Committed data are read back to be hashed by this size; hash state is 
+// published every HASH_STEP_SIZE bytes, so the saved state is not stale
+#define HASH_BUFFER_SIZE (1024 * 1024)
+#define HASH_STEP_SIZE   (32 * 1024 * 1024)
+
+// Range is hedged if it is expected to finish in more than HEDGE_MIN_ETA 
+// and its transfer has been running for HEDGE_MIN_AGE at least, msec
+#define HEDGE_MIN_ETA 2000
+#define HEDGE_MIN_AGE 3000
+
+WebFile::WebFile(TransferEngine *engine, RateLimiter *limiter, 
+				 const std::string& url, const StlString& fname, 
 				 unsigned int thread_count,
 				 HANDLE pause_event, HANDLE continue_event, HANDLE stop_event)
 {
 	InitLock(&lock_);
+	engine_ = engine;
+	limiter_ = limiter;
+	download_failed_ = false;
+	downloading_ = false;
+	terminating_ = false;
+	writer_ = NULL;
+	preallocate_ = false;
+	write_mode_ = WRITE_MODE_FILE;
+	mapping_handle_ = NULL;
+	file_error_ = 0;
+	flush_epoch_ = 0;
+	size_known_ = false;
+	single_stream_ = false;
+	file_size_ = 0;
+	reschedule_ = 0;
+	hash_buffer_ = NULL;
+	digest_type_ = DIGEST_MD5;
+	part_size_ = PART_SIZE;
+	ResetHash();
+	segments_done_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
 	url_ = url;
 	fname_ = fname;
 	downloaded_size_ = 0;
 	increment_ = 0;
+	recounted_size_ = 0;
 	thread_count_ = thread_count;
 	file_handle_ = INVALID_HANDLE_VALUE;
+	direct_handle_ = INVALID_HANDLE_VALUE;
+	thread_handle_ = NULL;
+	sample_start_ = GetTickCount();
+	error_count_ = 0;
 
 	pause_event_ = pause_event;
 	continue_event_ = continue_event;
 	stop_event_ = stop_event;
 	flags_ = 0;
-	part_num_ = 0;
+	next_offset_ = 0;
 	SetStatus(STATUS_DOWNLOAD_NOT_STARTED);
 }
 
-WebFile::WebFile(HANDLE pause_event, HANDLE continue_event, HANDLE stop_event)
+WebFile::WebFile(TransferEngine *engine, RateLimiter *limiter, 
+				 HANDLE pause_event, HANDLE continue_event, HANDLE stop_event)
 {
 	InitLock(&lock_);
+	engine_ = engine;
+	limiter_ = limiter;
+	download_failed_ = false;
+	downloading_ = false;
+	terminating_ = false;
+	writer_ = NULL;
+	preallocate_ = false;
+	write_mode_ = WRITE_MODE_FILE;
+	mapping_handle_ = NULL;
+	file_error_ = 0;
+	flush_epoch_ = 0;
+	size_known_ = false;
+	single_stream_ = false;
+	file_size_ = 0;
+	reschedule_ = 0;
+	hash_buffer_ = NULL;
+	digest_type_ = DIGEST_MD5;
+	part_size_ = PART_SIZE;
+	ResetHash();
+	segments_done_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
 	url_ = "";
 	fname_ = _T("");
 	downloaded_size_ = 0;
 	increment_ = 0;
+	recounted_size_ = 0;
 	thread_count_ = 0;
 	file_handle_ = INVALID_HANDLE_VALUE;
+	direct_handle_ = INVALID_HANDLE_VALUE;
+	thread_handle_ = NULL;
+	sample_start_ = GetTickCount();
+	error_count_ = 0;
 
 	pause_event_ = pause_event;
 	continue_event_ = continue_event;
 	stop_event_ = stop_event;
 	flags_ = 0;
-	part_num_ = 0;
+	next_offset_ = 0;
 	SetStatus(STATUS_DOWNLOAD_NOT_STARTED);
 }
 
@@ -57,27 +144,82 @@ void WebFile::Init(const std::string &url, const StlString& fname, unsigned int
 	fname_ = _T("");
 	downloaded_size_ = 0;
 	increment_ = 0;
+	recounted_size_ = 0;
 	thread_count_ = 0;
 	file_handle_ = INVALID_HANDLE_VALUE;
+	direct_handle_ = INVALID_HANDLE_VALUE;
+	mapping_handle_ = NULL;
+	thread_handle_ = NULL;
+	sample_start_ = GetTickCount();
+	error_count_ = 0;
 
 	pause_event_ = pause_event;
 	continue_event_ = continue_event;
 	stop_event_ = stop_event;
 	flags_ = FILE_RESTORED;
-	part_num_ = 0;
+	size_known_ = false;
+	single_stream_ = false;
+	file_size_ = 0;
+	next_offset_ = 0;
 	SetStatus(STATUS_DOWNLOAD_NOT_STARTED);
 }
 
 WebFile::~WebFile()
 {
+	// File thread is finished or terminated; segments are not active
+	WaitForWrites();
+	for (size_t i = 0; i < segments_.size(); i++)
+		delete segments_[i];
+	for (size_t i = 0; i < retired_segments_.size(); i++)
+		delete retired_segments_[i];
+	// Bandwidth bucket of the file is created on demand by its segments
+	if (limiter_)
+		limiter_->RemoveFile(url_);
+	if (thread_handle_)
+		CloseHandle(thread_handle_);
+	if (segments_done_event_)
+		CloseHandle(segments_done_event_);
+	if (hash_buffer_)
+		VirtualFree(hash_buffer_, 0, MEM_RELEASE);
 	CloseLock(&lock_);
 }
 
+void WebFile::SetMirrors(const std::list<std::string>& mirror_list)
+{
+	Lock(&lock_);
+	mirrors_.clear();
+	list<string> urls(mirror_list);
+	urls.push_front(url_);
+	for (list<string>::iterator iter = urls.begin(); iter != urls.end(); iter++)
+	{
+		bool duplicate = false;
+		for (size_t i = 0; i < mirrors_.size(); i++)
+			duplicate = duplicate || (mirrors_[i].url_ == *iter);
+		if (duplicate)
+			continue;
+		Mirror mirror;
+		mirror.url_ = *iter;
+		mirror.received_ = 0;
+		mirror.throughput_ = 0;
+		mirror.active_count_ = 0;
+		mirror.error_count_ = 0;
+		mirror.demote_start_ = 0;
+		mirror.demote_period_ = 0;
+		mirrors_.push_back(mirror);
+	}
+	Unlock(&lock_);
+}
+
 bool WebFile::Start()
 {
-	if (!HttpGetFileSize(url_, file_size_))
+	if (!segments_done_event_)
 		return false;
 
+	if (mirrors_.empty())
+		SetMirrors(list<string>());
+
+	// File size is not requested separately: it is taken from
+	// the response for the first range, see NotifyFileSize()
 	unsigned thread_id;
 	thread_handle_ = (HANDLE)_beginthreadex(NULL, 0, FileThread, this, 0, &thread_id);
 	
@@ -91,10 +233,13 @@ void WebFile::Stop()
 
 bool WebFile::Terminate()
 {
+	// Do not hold lock_ here: engine thread may wait for it in NotifyDownloadProgress
 	Lock(&lock_);
-	for (size_t i = 0; i < segments_.size(); i++)
-		(segments_[i])->Terminate();
+	terminating_ = true; // Segments are not deleted or scheduled from now
+	std::vector <WebFileSegment *> segments(segments_);
 	Unlock(&lock_);
+	for (size_t i = 0; i < segments.size(); i++)
+		segments[i]->Terminate();
 	return 0 != TerminateThread(thread_handle_, 0);
 }
 
@@ -103,74 +248,969 @@ bool WebFile::WaitForFinish(DWORD timeout)
 	return WAIT_OBJECT_0 == WaitForSingleObject(thread_handle_, timeout);
 }
 
-void WebFile::NotifyDownloadProgress(WebFileSegment *sender, 
+bool WebFile::NotifyDownloadProgress(WebFileSegment *sender, 
 									 unsigned long long offset, 
 									 void *data, size_t size)
 {
-	Lock(&lock_);
-	// Update total progress counter
-	downloaded_size_ += size;
-	increment_ += size;
-	LOG(("[NotifyDownloadProgress] size=0x%p downloaded_size_=0x%llx, increment_=0x%llx, offset=0x%llx\r\n", 
-		size, downloaded_size_, increment_, offset));
-	// Write data to file
+	// lock_ is not taken here: segments write at their own offsets, 
+	// and progress counters are updated atomically
+	size_t received = size;
+	mirrors_[sender->mirror_].received_ += size;
+	// Bytes which have been flushed by hedge peer are skipped; 
+	// the ones in its buffer are written twice
+	WebFileSegment *peer = sender->peer_;
+	if (peer)
+	{
+		unsigned long long peer_offset = peer->GetSegOffset() + AtomicRead64(&peer->flushed_size_);
+		if (peer_offset > offset)
+		{
+			size_t skip = (size_t)min((unsigned long long)size, peer_offset - offset);
+			offset += skip;
+			data = (char*)data + skip;
+			size -= skip;
+		}
+	}
+	if (size)
+	{
+		// Data which have failed to be written are not counted; 
+		// the transfer is aborted and retried from here
+		if (!BufferData(sender, offset, data, size))
+			return false;
+		// Update total progress counter
+		AtomicAdd64(&downloaded_size_, size);
+		AtomicAdd64(&increment_, size);
+		LOG(("[NotifyDownloadProgress] size=0x%p, offset=0x%llx\r\n", size, offset));
+	}
+	AtomicAdd64(&sender->downloaded_size_, received);
+	// Saved state covers flushed bytes only
+	if (0 == sender->buffer_used_ && 0 == sender->pending_writes_ && !sender->write_error_)
+		AtomicExchange64(&sender->flushed_size_, sender->downloaded_size_);
+	return true;
+}
+
+bool WebFile::WriteAt(unsigned long long offset, void *data, size_t size)
+{
+	// Positional write: file pointer is not shared by segments
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
 	LARGE_INTEGER tmp;
 	tmp.QuadPart = offset;
-	SetFilePointer(file_handle_, tmp.LowPart, &tmp.HighPart, FILE_BEGIN);
+	overlapped.Offset = tmp.LowPart;
+	overlapped.OffsetHigh = tmp.HighPart;
 	DWORD nr_written;
-	WriteFile(file_handle_, data, (DWORD)size, &nr_written, NULL);
-	assert((size_t)nr_written == size);
+	if (!WriteFile(file_handle_, data, (DWORD)size, &nr_written, &overlapped) 
+		|| (size_t)nr_written != size)
+	{
+		LOG(("[WriteAt] %s: offset=0x%llx, size=0x%x, error %u\n", 
+			url_.c_str(), offset, size, GetLastError()));
+		return false;
+	}
+	return true;
+}
+
+void WebFile::MapFile()
+{
+	if (WRITE_MODE_MAPPED != write_mode_ || mapping_handle_ || 0 == file_size_)
+		return;
+	// File is extended to the mapping size
+	LARGE_INTEGER size;
+	size.QuadPart = file_size_;
+	mapping_handle_ = CreateFileMapping(file_handle_, NULL, PAGE_READWRITE, 
+		size.HighPart, size.LowPart, NULL);
+	if (!mapping_handle_)
+		LOG(("[MapFile] %s: error %u; data are written to file\n", url_.c_str(), GetLastError()));
+}
+
+bool WebFile::WriteMapped(WebFileSegment *seg, unsigned long long offset, void *data, size_t size)
+{
+	if (offset + size > file_size_)
+		return WriteAt(offset, data, size);
+	while (size)
+	{
+		if (!seg->view_ || offset < seg->view_offset_ || offset >= seg->view_offset_ + seg->view_size_)
+		{
+			UnmapView(seg);
+			unsigned long long view_offset = offset & ~(unsigned long long)(MAP_VIEW_ALIGNMENT - 1);
+			size_t view_size = (size_t)min((unsigned long long)MAP_VIEW_SIZE, file_size_ - view_offset);
+			LARGE_INTEGER tmp;
+			tmp.QuadPart = view_offset;
+			seg->view_ = (BYTE*)MapViewOfFile(mapping_handle_, FILE_MAP_WRITE, 
+				tmp.HighPart, tmp.LowPart, view_size);
+			if (!seg->view_)
+			{
+				// Address space may be exhausted by views of other segments
+				LOG(("[WriteMapped] offset=0x%llx, error %u\n", view_offset, GetLastError()));
+				return WriteAt(offset, data, size);
+			}
+			seg->view_offset_ = view_offset;
+			seg->view_size_ = view_size;
+		}
+		size_t chunk = (size_t)min((unsigned long long)size, seg->view_offset_ + seg->view_size_ - offset);
+		memcpy(seg->view_ + (size_t)(offset - seg->view_offset_), data, chunk);
+		offset += chunk;
+		data = (char*)data + chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+void WebFile::UnmapView(WebFileSegment *seg)
+{
+	if (seg->view_)
+	{
+		UnmapViewOfFile(seg->view_);
+		seg->view_ = NULL;
+		seg->view_size_ = 0;
+	}
+}
+
+size_t WebFile::GetBufferSkew(unsigned long long offset)
+{
+	return (INVALID_HANDLE_VALUE != direct_handle_) ? (size_t)(offset % DIRECT_IO_ALIGNMENT) : 0;
+}
+
+bool WebFile::ReserveBuffer(WebFileSegment *seg, size_t size)
+{
+	if (mapping_handle_ || !writer_ || size > writer_->GetBufferSize())
+		return true; // Written directly
+	size_t skew = seg->buffer_used_ ? seg->buffer_skew_ 
+		: GetBufferSkew(seg->GetSegOffset() + seg->downloaded_size_);
+	if (seg->buffer_ && skew + seg->buffer_used_ + size <= writer_->GetBufferSize())
+		return true;
+	// Full buffer goes to disk writer; the data need a new one
+	FlushBuffer(seg);
+	seg->buffer_ = writer_->AcquireBuffer();
+	return NULL != seg->buffer_;
+}
+
+bool WebFile::BufferData(WebFileSegment *seg, unsigned long long offset, void *data, size_t size)
+{
+	if (mapping_handle_)
+		return WriteMapped(seg, offset, data, size);
+	// Buffer holds continuous data which precede the segment position
+	if (seg->buffer_used_ && seg->buffer_offset_ + seg->buffer_used_ != offset)
+		FlushBuffer(seg);
+	if (!seg->buffer_ && writer_)
+		seg->buffer_ = writer_->AcquireBuffer();
+
+	// Space is reserved before data are accepted; if it is not there 
+	// (buffering is disabled, or gap left by hedge peer), write at once
+	size_t skew = seg->buffer_used_ ? seg->buffer_skew_ : GetBufferSkew(offset);
+	if (!seg->buffer_ || skew + seg->buffer_used_ + size > writer_->GetBufferSize())
+	{
+		FlushBuffer(seg);
+		return WriteAt(offset, data, size);
+	}
+
+	if (0 == seg->buffer_used_)
+	{
+		seg->buffer_offset_ = offset;
+		seg->buffer_skew_ = skew;
+	}
+	memcpy(seg->buffer_ + skew + seg->buffer_used_, data, size);
+	seg->buffer_used_ += size;
+	return true;
+}
+
+void WebFile::FlushBuffer(WebFileSegment *seg)
+{
+	// Dirty pages of the view are written along with download state
+	if (seg->view_)
+		FlushViewOfFile(seg->view_, 0);
+	if (seg->buffer_used_)
+	{
+		LOG(("[FlushBuffer] offset=0x%llx, size=0x%x\n", seg->buffer_offset_, seg->buffer_used_));
+		// Buffer is released by disk writer; flushed size is updated when it is written
+		unsigned long long start = seg->buffer_offset_;
+		unsigned long long end = start + seg->buffer_used_;
+		unsigned long long direct_start = (start + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+		unsigned long long direct_end = end / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+		if (INVALID_HANDLE_VALUE != direct_handle_ && direct_start < direct_end)
+		{
+			// Whole pages bypass system cache. Partial pages at the edges may be 
+			// shared with adjacent ranges; they are written through the cache.
+			// Writes are completed in order, so the last one releases the buffer.
+			if (direct_start > start)
+				writer_->Submit(file_handle_, start, seg->buffer_, seg->buffer_skew_, 
+					(size_t)(direct_start - start), NULL, 0, &seg->pending_writes_, &seg->write_error_);
+			if (end > direct_end)
+				writer_->Submit(file_handle_, direct_end, seg->buffer_, 
+					seg->buffer_skew_ + (size_t)(direct_end - start), (size_t)(end - direct_end), 
+					NULL, 0, &seg->pending_writes_, &seg->write_error_);
+			writer_->Submit(direct_handle_, direct_start, seg->buffer_, 
+				seg->buffer_skew_ + (size_t)(direct_start - start), (size_t)(direct_end - direct_start), 
+				&seg->flushed_size_, seg->downloaded_size_, &seg->pending_writes_, &seg->write_error_);
+		}
+		else
+			writer_->Submit(file_handle_, start, seg->buffer_, seg->buffer_skew_, seg->buffer_used_, 
+				&seg->flushed_size_, seg->downloaded_size_, &seg->pending_writes_, &seg->write_error_);
+		seg->buffer_ = NULL;
+		seg->buffer_used_ = 0;
+	}
+	else if (0 == seg->pending_writes_ && !seg->write_error_)
+		AtomicExchange64(&seg->flushed_size_, seg->downloaded_size_);
+}
+
+bool WebFile::HasFreeBuffer()
+{
+	return !writer_ || writer_->HasFreeBuffer();
+}
+
+void WebFile::SetPreallocate(bool preallocate)
+{
+	preallocate_ = preallocate;
+}
+
+bool WebFile::Preallocate()
+{
+	// File restored from download state has been allocated already
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(file_handle_, &size) && (unsigned long long)size.QuadPart >= file_size_)
+		return true;
+
+	size.QuadPart = file_size_;
+	if (!SetFilePointerEx(file_handle_, size, NULL, FILE_BEGIN) || !SetEndOfFile(file_handle_))
+	{
+		LOG(("[Preallocate] %s: size=0x%llx, error %u\n", url_.c_str(), file_size_, GetLastError()));
+		return false;
+	}
+	// Writes at high offsets do not wait for the gap to be zeroed if valid 
+	// data length is moved. Requires SE_MANAGE_VOLUME_NAME privilege; not fatal.
+	if (!SetFileValidData(file_handle_, size.QuadPart))
+		LOG(("[Preallocate] Valid data length is not set, error %u\n", GetLastError()));
+	return true;
+}
+
+void WebFile::SetWriteMode(unsigned int write_mode)
+{
+	write_mode_ = write_mode;
+}
+
+void WebFile::SetDigestParameters(unsigned int digest_type, unsigned long long part_size)
+{
+	Lock(&lock_);
+	if (digest_type != digest_type_ || part_size != part_size_)
+	{
+		// Restored hash state is useless; new downloads are hashed from the start
+		digest_type_ = digest_type;
+		part_size_ = part_size;
+		ResetHash();
+		if (flags_ & FILE_RESTORED)
+			hash_valid_ = false;
+	}
+	Unlock(&lock_);
+}
+
+void WebFile::SetRepairRanges(unsigned long long file_size, 
+							  const std::list<std::pair<unsigned long long, unsigned long long> >& ranges)
+{
+	Lock(&lock_);
+	// Ranges are queued as segments of restored file; everything else is downloaded
+	file_size_ = file_size;
+	size_known_ = true;
+	next_offset_ = file_size;
+	unsigned long long repair_size = 0;
+	for (list<pair<unsigned long long, unsigned long long> >::const_iterator iter = ranges.begin(); 
+		iter != ranges.end(); iter++)
+	{
+		WebFileSegment *seg = new WebFileSegment(this, url_, iter->first, iter->second, 
+			pause_event_, continue_event_, stop_event_);
+		segments_.push_back(seg);
+		repair_size += iter->second;
+	}
+	downloaded_size_ = file_size - repair_size;
+	flags_ |= FILE_RESTORED;
+	// Repaired parts are read to be verified
+	ResetHash();
+	hash_valid_ = false;
 	Unlock(&lock_);
 }
 
+void WebFile::SetDiskWriter(DiskWriter *writer)
+{
+	writer_ = (writer && writer->IsStarted()) ? writer : NULL;
+}
+
+void WebFile::WaitForWrites()
+{
+	for (;;)
+	{
+		bool pending = false;
+		Lock(&lock_);
+		for (size_t i = 0; i < segments_.size(); i++)
+			pending = pending || (0 != segments_[i]->pending_writes_);
+		for (size_t i = 0; i < retired_segments_.size(); i++)
+			pending = pending || (0 != retired_segments_[i]->pending_writes_);
+		Unlock(&lock_);
+		if (!pending)
+			break;
+		Sleep(WRITE_WAIT_PERIOD);
+	}
+}
+
+void WebFile::DeleteRetiredSegments()
+{
+	for (size_t i = 0; i < retired_segments_.size(); )
+	{
+		WebFileSegment *seg = retired_segments_[i];
+		if (0 == seg->pending_writes_)
+		{
+			retired_segments_.erase(retired_segments_.begin() + i);
+			if (seg->write_error_)
+			{
+				// Range is not on disk; it is queued again
+				error_count_++;
+				if (!seg->ScheduleRetry())
+					download_failed_ = true;
+				RewindSegment(seg);
+				segments_.push_back(seg);
+			}
+			else
+				delete seg;
+		}
+		else
+			i++;
+	}
+}
+
+void WebFile::RewindSegment(WebFileSegment *seg)
+{
+	unsigned long long flushed_size = AtomicRead64(&seg->flushed_size_);
+	LOG(("[RewindSegment] %s: error %u, range is downloaded again from 0x%llx\n", 
+		url_.c_str(), seg->write_error_, seg->GetSegOffset() + flushed_size));
+	// Progress counters lose the bytes which are downloaded again
+	Uncount(seg->downloaded_size_ - flushed_size);
+	AtomicExchange64(&seg->downloaded_size_, flushed_size);
+	seg->write_error_ = 0;
+	seg->SetStatus(STATUS_DOWNLOAD_FAILURE);
+}
+
+void WebFile::RecoverWriteErrors()
+{
+	for (size_t i = 0; i < segments_.size(); i++)
+	{
+		WebFileSegment *seg = segments_[i];
+		if (!seg->IsActive() && seg->write_error_ && 0 == seg->pending_writes_)
+			RewindSegment(seg);
+	}
+}
+
+void WebFile::FlushBuffers()
+{
+	InterlockedIncrement(&flush_epoch_);
+}
+
+void WebFile::ResetHash()
+{
+	hashed_offset_ = 0;
+	part_state_ = "";
+	file_state_ = "";
+	part_digests_.clear();
+	hash_valid_ = true;
+}
+
+unsigned long long WebFile::GetCommittedSize()
+{
+	// Every range below next_offset_ is either downloaded or covered by a segment
+	unsigned long long committed = next_offset_;
+	for (size_t i = 0; i < segments_.size(); i++)
+		committed = min(committed, 
+			segments_[i]->GetSegOffset() + AtomicRead64(&segments_[i]->flushed_size_));
+	for (size_t i = 0; i < retired_segments_.size(); i++)
+		committed = min(committed, 
+			retired_segments_[i]->GetSegOffset() + AtomicRead64(&retired_segments_[i]->flushed_size_));
+	return committed;
+}
+
+static size_t ReadAt(HANDLE file_handle, unsigned long long offset, void *data, size_t size)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	LARGE_INTEGER tmp;
+	tmp.QuadPart = offset;
+	overlapped.Offset = tmp.LowPart;
+	overlapped.OffsetHigh = tmp.HighPart;
+	DWORD nr_read;
+	if (!ReadFile(file_handle, data, (DWORD)size, &nr_read, &overlapped))
+		return 0;
+	return nr_read;
+}
+
+bool WebFile::HashCommittedData(unsigned long long max_size)
+{
+	// Hash state is copied; the saved one is consistent while data are hashed
+	Lock(&lock_);
+	bool valid = hash_valid_;
+	unsigned long long offset = hashed_offset_;
+	unsigned long long committed = GetCommittedSize();
+	unsigned int digest_type = digest_type_;
+	unsigned long long part_size = part_size_;
+	string part_state = part_state_;
+	string file_state = file_state_;
+	Unlock(&lock_);
+
+	if (!valid || committed <= offset)
+		return false;
+	if (committed - offset > max_size)
+		committed = offset + max_size;
+	if (!hash_buffer_)
+		hash_buffer_ = (BYTE*)VirtualAlloc(NULL, HASH_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+	if (!hash_buffer_)
+		return false;
+
+	// Whole-file digest of tree is computed from part digests
+	Digest *part_digest = Digest::Create(digest_type);
+	Digest *file_digest = Digest::IsTree(digest_type) ? NULL : Digest::Create(digest_type);
+	if (!part_digest || (!part_state.empty() && !part_digest->SetState(part_state)))
+		valid = false;
+	if (file_digest && !file_state.empty() && !file_digest->SetState(file_state))
+		valid = false;
+
+	list<string> digests;
+	bool stopped = false;
+	while (offset < committed && valid)
+	{
+		stopped = (WAIT_OBJECT_0 == WaitForSingleObject(stop_event_, 0));
+		if (stopped)
+			break;
+
+		// Unbuffered handle reads whole pages; the data are taken from the middle.
+		// Data written by disk writer through it are not cached, so this is a disk read.
+		HANDLE handle = file_handle_;
+		size_t skip = 0;
+		size_t size = (size_t)min((unsigned long long)HASH_BUFFER_SIZE, committed - offset);
+		size_t read_size = size;
+		if (INVALID_HANDLE_VALUE != direct_handle_)
+		{
+			handle = direct_handle_;
+			skip = (size_t)(offset % DIRECT_IO_ALIGNMENT);
+			size = min(size, HASH_BUFFER_SIZE - skip);
+			read_size = (skip + size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+		}
+		if (ReadAt(handle, offset - skip, hash_buffer_, read_size) < skip + size)
+		{
+			LOG(("[HashCommittedData] %s: read failed at 0x%llx, error %u\n", 
+				url_.c_str(), offset, GetLastError()));
+			valid = false;
+			break;
+		}
+
+		BYTE *data = hash_buffer_ + skip;
+		while (size)
+		{
+			size_t append_size = (size_t)min((unsigned long long)size, part_size - offset % part_size);
+			part_digest->Append(data, (int)append_size);
+			if (file_digest)
+				file_digest->Append(data, (int)append_size);
+			data += append_size;
+			size -= append_size;
+			offset += append_size;
+			if (0 == offset % part_size)
+			{
+				digests.push_back(part_digest->Finish());
+				part_digest->Reset();
+			}
+		}
+	}
+
+	if (valid)
+	{
+		part_state = part_digest->GetState();
+		if (file_digest)
+			file_state = file_digest->GetState();
+	}
+	delete part_digest;
+	delete file_digest;
+
+	Lock(&lock_);
+	hash_valid_ = valid;
+	hashed_offset_ = offset;
+	part_state_ = part_state;
+	file_state_ = file_state;
+	part_digests_.splice(part_digests_.end(), digests);
+	bool ret_val = valid && !stopped && hashed_offset_ < GetCommittedSize();
+	Unlock(&lock_);
+	return ret_val;
+}
+
+bool WebFile::GetDigests(__out std::vector<std::string>& part_digests, __out std::string& file_digest)
+{
+	Lock(&lock_);
+	// Unknown digest type of loaded state: the file is read to be verified
+	Digest *digest = Digest::Create(digest_type_);
+	bool ret_val = digest && hash_valid_ && size_known_ && hashed_offset_ == file_size_;
+	if (ret_val)
+	{
+		// Saved state is not finished: hashing may be continued
+		part_digests.assign(part_digests_.begin(), part_digests_.end());
+		if (hashed_offset_ % part_size_)
+		{
+			digest->SetState(part_state_);
+			part_digests.push_back(digest->Finish());
+		}
+		if (Digest::IsTree(digest_type_))
+			file_digest = Digest::GetTreeRoot(digest_type_, part_digests);
+		else
+		{
+			digest->Reset();
+			if (!file_state_.empty())
+				digest->SetState(file_state_);
+			file_digest = digest->Finish();
+		}
+	}
+	Unlock(&lock_);
+	delete digest;
+	return ret_val;
+}
+
+void WebFile::NotifySegmentDone(WebFileSegment *sender)
+{
+	Lock(&lock_);
+	sender->active_ = false;
+	Mirror& mirror = mirrors_[sender->mirror_];
+	if (mirror.active_count_)
+		mirror.active_count_--;
+	if (!terminating_)
+	{
+		WebFileSegment *peer = sender->peer_;
+		if (STATUS_DOWNLOAD_FINISHED == sender->GetStatus())
+		{
+			mirror.error_count_ = 0;
+			// Hedge race is over; the loser has nothing to download
+			if (peer)
+			{
+				LOG(("[NotifySegmentDone] Hedged range 0x%llx is done; cancel the other transfer\n", 
+					sender->GetSegOffset()));
+				if (peer->IsActive() && mirrors_[peer->mirror_].active_count_)
+					mirrors_[peer->mirror_].active_count_--;
+				// Bytes which the loser has not flushed have not been skipped 
+				// by the winner; they are counted in progress twice
+				unsigned long long peer_end = peer->GetSegOffset() + peer->downloaded_size_;
+				unsigned long long peer_flushed = max(peer->GetSegOffset() + AtomicRead64(&peer->flushed_size_), 
+					sender->GetSegOffset());
+				if (peer_end > peer_flushed)
+					Uncount(peer_end - peer_flushed);
+				peer->Terminate(); // Detached at once: called from engine thread
+				DeleteSegment(peer);
+			}
+			// Finished range is below next_offset_ and is not covered by any segment
+			DeleteSegment(sender);
+		}
+		else if (peer && peer->IsActive() && !sender->write_error_)
+		{
+			// The rest of range is downloaded by hedge peer
+			DeleteSegment(sender);
+		}
+		else if (WAIT_OBJECT_0 != WaitForSingleObject(stop_event_, 0))
+		{
+			// Range is kept in the queue and retried later, 
+			// possibly from another mirror. Other ranges keep running.
+			error_count_++;
+			DemoteMirror(sender->mirror_);
+			if (!sender->ScheduleRetry())
+				download_failed_ = true;
+		}
+		// Connection is free now; give it some work. Called from engine thread,
+		// so in-flight segments can be split safely.
+		ScheduleSegments(true);
+	}
+	Unlock(&lock_);
+}
+
+bool WebFile::NotifyFileSize(WebFileSegment *sender, unsigned long long size, bool range_supported)
+{
+	Lock(&lock_);
+	bool ret_val = true;
+	if (!size_known_)
+	{
+		LOG(("[NotifyFileSize] %s: size=0x%llx, range_supported=%u\n", 
+			url_.c_str(), size, range_supported));
+		file_size_ = size;
+		size_known_ = true;
+		single_stream_ = !range_supported;
+		// The first segment gets the regular size; the rest of the file
+		// is scheduled to free connections at once
+		sender->size_ = single_stream_ ? size : GetNextSegmentSize();
+		next_offset_ = sender->size_;
+		if (preallocate_ && !Preallocate())
+		{
+			file_error_ = STATUS_NO_DISK_SPACE;
+			download_failed_ = true;
+			ret_val = false;
+		}
+		else
+		{
+			MapFile();
+			if (downloading_ && !terminating_)
+				ScheduleSegments(true);
+		}
+	}
+	else if (size != file_size_)
+	{
+		LOG(("[NotifyFileSize] %s: size=0x%llx differs from 0x%llx\n", 
+			mirrors_[sender->mirror_].url_.c_str(), size, file_size_));
+		ret_val = false;
+	}
+	Unlock(&lock_);
+	return ret_val;
+}
+
 void WebFile::UpdateThreadCount(unsigned int thread_count)
 {
-	flags_ |= FILE_THREAD_COUNT_CHANGED;
+	Lock(&lock_);
 	thread_count_ = thread_count;
-	SetEvent(stop_event_);
+	// Extra connections (if any) are not reused when their segments finish.
+	// New connections are launched at once if there are queued ranges;
+	// in-flight ranges are split on the next engine tick.
+	if (downloading_)
+		ScheduleSegments(false);
+	InterlockedExchange(&reschedule_, 1);
+	Unlock(&lock_);
 }
 
-unsigned __stdcall WebFile::FileThread(void *arg)
+void WebFile::NotifyTick()
 {
-	WebFile *file = (WebFile*)arg;
+	if (GetTickCount() - sample_start_ >= MIRROR_SAMPLE_PERIOD)
+	{
+		Lock(&lock_);
+		SampleThroughput();
+		Unlock(&lock_);
+	}
 
-	// Every file is split into parts
+	if (!retired_segments_.empty())
+	{
+		Lock(&lock_);
+		DeleteRetiredSegments();
+		Unlock(&lock_);
+	}
 
-	unsigned long long offset = 0;
+	if (InterlockedExchange(&reschedule_, 0))
+	{
+		Lock(&lock_);
+		if (downloading_ && !terminating_)
+			ScheduleSegments(true);
+		Unlock(&lock_);
+	}
+}
 
-	file->file_handle_ = OpenOrCreate(file->fname_, GENERIC_WRITE);
-	if (INVALID_HANDLE_VALUE == file->file_handle_)
+void WebFile::ScheduleSegments(bool split_active)
+{
+	unsigned int running = 0;
+	for (size_t i = 0; i < segments_.size(); i++)
+		if (segments_[i]->IsActive())
+			running++;
+
+	bool stopped = (WAIT_OBJECT_0 == WaitForSingleObject(stop_event_, 0));
+
+	RecoverWriteErrors();
+
+	while (!download_failed_ && !stopped && running < thread_count_)
 	{
-		file->SetStatus(STATUS_FILE_CREATE_FAILURE);
-		goto __end;
+		// All mirrors are demoted; failed ranges are retried when demotion expires
+		int mirror = SelectMirror();
+		if (mirror < 0)
+			break;
+
+		WebFileSegment *seg = NULL;
+		for (size_t i = 0; i < segments_.size(); i++)
+		{
+			if (!segments_[i]->IsActive() 
+				&& STATUS_DOWNLOAD_FINISHED != segments_[i]->GetStatus()
+				&& segments_[i]->GetRemainingSize() > 0
+				&& !segments_[i]->write_error_
+				&& segments_[i]->IsRetryDue())
+			{
+				seg = segments_[i];
+				break;
+			}
+		}
+		if (!seg)
+			seg = CreateNextSegment();
+		if (!seg)
+			seg = SplitLargestSegment(split_active);
+		if (!seg)
+			seg = HedgeSlowestSegment();
+		if (!seg)
+			break;
+		if (seg->peer_ && mirror == (int)seg->peer_->mirror_)
+		{
+			// Hedge goes to another mirror, if there is one
+			int other = SelectMirror(mirror);
+			if (other >= 0)
+				mirror = other;
+		}
+		seg->mirror_ = mirror;
+		seg->url_ = mirrors_[mirror].url_;
+		if (!seg->Start())
+		{
+			download_failed_ = true;
+			break;
+		}
+		mirrors_[mirror].active_count_++;
+		running++;
 	}
 
-	file->SetStatus(STATUS_DOWNLOAD_STARTED);
+	// Download is not finished while there are ranges waiting for retry
+	unsigned int waiting = 0;
+	for (size_t i = 0; i < segments_.size(); i++)
+		if (!segments_[i]->IsActive() 
+			&& (segments_[i]->GetRemainingSize() > 0 || segments_[i]->write_error_))
+			waiting++;
 
-	for (size_t part_num = file->part_num_; offset < file->file_size_; ) 
+	if (0 == running && (0 == waiting || download_failed_ || stopped))
+		SetEvent(segments_done_event_);
+}
+
+int WebFile::SelectMirror(int avoid)
+{
+	DWORD now = GetTickCount();
+
+	// Mirrors which have not been measured yet are supposed to be as fast as the best one
+	double max_throughput = 0;
+	for (size_t i = 0; i < mirrors_.size(); i++)
+		max_throughput = max(max_throughput, mirrors_[i].throughput_);
+	if (0 == max_throughput)
+		max_throughput = 1;
+
+	// Connection goes to the mirror with the largest throughput per connection
+	// if one more connection is added; thus connections are shared by mirrors
+	// proportionally to their throughput
+	int best = -1;
+	double best_score = 0;
+	for (size_t i = 0; i < mirrors_.size(); i++)
 	{
-		unsigned long long part_size = PART_SIZE;
-		if (offset + PART_SIZE >= file->file_size_)
-			part_size = file->file_size_ - offset;
-		file->DownloadPart(part_num, offset, part_size, file->thread_count_);
-		if (file->flags_ & FILE_THREAD_COUNT_CHANGED)
+		Mirror& mirror = mirrors_[i];
+		if (mirror.error_count_ && now - mirror.demote_start_ < mirror.demote_period_)
+			continue;
+		if ((int)i == avoid)
+			continue;
+		double throughput = mirror.throughput_ ? mirror.throughput_ : max_throughput;
+		double score = throughput / (mirror.active_count_ + 1);
+		if (best < 0 || score > best_score)
 		{
-			// Thread count has been changed. Do not restart whole file, restart
-			// current part only.
-			file->flags_ &= ~FILE_THREAD_COUNT_CHANGED;
-			ResetEvent(file->stop_event_);
+			best = (int)i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+void WebFile::DemoteMirror(unsigned int mirror)
+{
+	Mirror& m = mirrors_[mirror];
+	m.error_count_++;
+	m.throughput_ /= 2;
+	m.demote_start_ = GetTickCount();
+	m.demote_period_ = MIRROR_DEMOTE_PERIOD << min(m.error_count_ - 1, (unsigned int)MIRROR_MAX_DEMOTE_SHIFT);
+	LOG(("[DemoteMirror] %s, error_count=%u, period=%u\n", 
+		m.url_.c_str(), m.error_count_, m.demote_period_));
+}
+
+void WebFile::SampleThroughput()
+{
+	DWORD elapsed = GetTickCount() - sample_start_;
+	if (elapsed < MIRROR_SAMPLE_PERIOD)
+		return;
+	sample_start_ += elapsed;
+
+	// Nothing is received while paused; keep previous values
+	bool paused = (WAIT_OBJECT_0 == WaitForSingleObject(pause_event_, 0));
+
+	for (size_t i = 0; i < mirrors_.size(); i++)
+	{
+		Mirror& mirror = mirrors_[i];
+		if (!paused && mirror.active_count_)
+		{
+			double sample = (double)mirror.received_ / elapsed / mirror.active_count_;
+			mirror.throughput_ = mirror.throughput_ ? (3 * mirror.throughput_ + sample) / 4 : sample;
+		}
+		mirror.received_ = 0;
+	}
+}
+
+unsigned long long WebFile::GetNextSegmentSize()
+{
+	// Ranges follow each other continuously within windows of PART_SIZE 
+	// rounded up to whole parts of manifest. Window boundaries are not 
+	// crossed, thus every window is downloaded by thread_count_ connections 
+	// at most, and verified parts do not span windows.
+	unsigned long long window = (PART_SIZE + part_size_ - 1) / part_size_ * part_size_;
+	unsigned long long seg_size = window / thread_count_;
+	if (seg_size < MIN_SPLIT_SIZE)
+		seg_size = MIN_SPLIT_SIZE;
+	unsigned long long part_end = (next_offset_ / window + 1) * window;
+	if (part_end > file_size_)
+		part_end = file_size_;
+	if (next_offset_ + seg_size > part_end || part_end - (next_offset_ + seg_size) < MIN_SPLIT_SIZE)
+		seg_size = part_end - next_offset_;
+	return seg_size;
+}
+
+WebFileSegment *WebFile::CreateNextSegment()
+{
+	if (!size_known_)
+	{
+		// The first range is open-ended; nothing else is scheduled 
+		// until the file size is received
+		if (!segments_.empty())
+			return NULL;
+		WebFileSegment *seg = new WebFileSegment(this, url_, 0, SEGMENT_SIZE_UNKNOWN, 
+			pause_event_, continue_event_, stop_event_);
+		segments_.push_back(seg);
+		return seg;
+	}
+
+	if (next_offset_ >= file_size_)
+		return NULL;
+
+	unsigned long long seg_size = GetNextSegmentSize();
+	WebFileSegment *seg = new WebFileSegment(this, url_, next_offset_, seg_size, 
+		pause_event_, continue_event_, stop_event_);
+	segments_.push_back(seg);
+	next_offset_ += seg_size;
+	return seg;
+}
+
+WebFileSegment *WebFile::SplitLargestSegment(bool split_active)
+{
+	if (!size_known_ || single_stream_)
+		return NULL;
+
+	WebFileSegment *victim = NULL;
+	unsigned long long max_remaining = 0;
+	for (size_t i = 0; i < segments_.size(); i++)
+	{
+		WebFileSegment *seg = segments_[i];
+		if ((seg->IsActive() && !split_active) || seg->peer_)
 			continue;
+		if (STATUS_DOWNLOAD_FINISHED != seg->GetStatus() && seg->GetRemainingSize() > max_remaining)
+		{
+			victim = seg;
+			max_remaining = seg->GetRemainingSize();
 		}
-		part_num++;
-		offset += PART_SIZE;
 	}
 
+	if (!victim || max_remaining < 2 * MIN_SPLIT_SIZE)
+		return NULL;
+
+	unsigned long long tail_size = max_remaining / 2;
+	unsigned long long new_size = victim->GetSize() - tail_size;
+	victim->Shrink(new_size);
+
+	LOG(("[SplitLargestSegment] offset=0x%llx, new_size=0x%llx, tail_size=0x%llx\n", 
+		victim->GetSegOffset(), new_size, tail_size));
+
+	WebFileSegment *tail = new WebFileSegment(this, url_, 
+		victim->GetSegOffset() + new_size, tail_size, 
+		pause_event_, continue_event_, stop_event_);
+	segments_.push_back(tail);
+	return tail;
+}
+
+WebFileSegment *WebFile::HedgeSlowestSegment()
+{
+	if (!size_known_ || single_stream_)
+		return NULL;
+
+	WebFileSegment *victim = NULL;
+	double max_eta = HEDGE_MIN_ETA;
+	DWORD now = GetTickCount();
+	for (size_t i = 0; i < segments_.size(); i++)
+	{
+		WebFileSegment *seg = segments_[i];
+		if (!seg->IsActive() || seg->peer_ || 0 == seg->GetRemainingSize())
+			continue;
+		DWORD elapsed = now - seg->start_tick_;
+		if (elapsed < HEDGE_MIN_AGE)
+			continue;
+		// Expected time to finish, msec
+		double speed = (double)(seg->GetDownloadedSize() - seg->attempt_size_) / elapsed;
+		double eta = (speed > 0) ? seg->GetRemainingSize() / speed : DBL_MAX;
+		if (eta > max_eta)
+		{
+			victim = seg;
+			max_eta = eta;
+		}
+	}
+
+	if (!victim)
+		return NULL;
+
+	unsigned long long offset = victim->GetSegOffset() + victim->GetDownloadedSize();
+
+	LOG(("[HedgeSlowestSegment] offset=0x%llx, size=0x%llx, eta=%.0f\n", 
+		offset, victim->GetRemainingSize(), max_eta));
+
+	WebFileSegment *hedge = new WebFileSegment(this, url_, 
+		offset, victim->GetRemainingSize(), 
+		pause_event_, continue_event_, stop_event_);
+	hedge->peer_ = victim;
+	victim->peer_ = hedge;
+	segments_.push_back(hedge);
+	return hedge;
+}
+
+void WebFile::DeleteSegment(WebFileSegment *seg)
+{
+	if (seg->peer_)
+	{
+		seg->peer_->peer_ = NULL;
+		seg->peer_ = NULL;
+	}
+	segments_.erase(find(segments_.begin(), segments_.end(), seg));
+	// Segment is kept until its buffers are written: disk writer updates 
+	// its flushed size, and the range is saved in state until then. 
+	// Range which has failed to be written is queued again.
+	if (seg->pending_writes_ || seg->write_error_)
+		retired_segments_.push_back(seg);
+	else
+		delete seg;
+}
+
+unsigned __stdcall WebFile::FileThread(void *arg)
+{
+	WebFile *file = (WebFile*)arg;
+
+	// Data are read back to be hashed. Unbuffered handle is opened 
+	// along with the regular one, which writes partial pages.
+	file->file_handle_ = OpenOrCreate(file->fname_, GENERIC_READ | GENERIC_WRITE,
+		WRITE_MODE_DIRECT == file->write_mode_ ? FILE_SHARE_READ | FILE_SHARE_WRITE : FILE_SHARE_READ);
+	if (INVALID_HANDLE_VALUE == file->file_handle_)
+	{
+		file->SetStatus(STATUS_FILE_CREATE_FAILURE);
+		goto __end;
+	}
+	if (WRITE_MODE_DIRECT == file->write_mode_ && file->writer_)
+	{
+		file->direct_handle_ = OpenOrCreate(file->fname_, GENERIC_READ | GENERIC_WRITE, 
+			FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_NO_BUFFERING);
+		if (INVALID_HANDLE_VALUE == file->direct_handle_)
+			LOG(("[FileThread] Unbuffered handle is not opened, error %u\n", GetLastError()));
+	}
+
+	file->SetStatus(STATUS_DOWNLOAD_STARTED);
+
+	file->Download();
+
 	unsigned int status;
 	unsigned long long size, increment;
 	file->GetDownloadStatus(status, size, increment);
-	if (STATUS_DOWNLOAD_FAILURE != status)
+	if (STATUS_DOWNLOAD_FAILURE != status && STATUS_NO_DISK_SPACE != status 
+		&& STATUS_DOWNLOAD_STOPPED != status)
 		file->SetStatus(STATUS_DOWNLOAD_FINISHED);
 
+	file->WaitForWrites();
+	// Views of finished and terminated segments are unmapped already
+	if (file->mapping_handle_)
+	{
+		CloseHandle(file->mapping_handle_);
+		file->mapping_handle_ = NULL;
+	}
+	if (INVALID_HANDLE_VALUE != file->direct_handle_)
+	{
+		CloseHandle(file->direct_handle_);
+		file->direct_handle_ = INVALID_HANDLE_VALUE;
+	}
 	CloseHandle(file->file_handle_);
 
 __end:
@@ -178,55 +1218,110 @@ __end:
 	return 0;
 }
 
-bool WebFile::DownloadPart(size_t part_num, unsigned long long offset, 
-						   unsigned long long size, unsigned int thread_count)
+/**
+ *	Download the whole file with continuous range scheduler.
+ *	Connections flow from one range to the next one without waiting 
+ *	for each other; parts of manifest are only used as verification granularity.
+ */
+bool WebFile::Download()
 {
 	Lock(&lock_);
 
 	if (0 == (flags_ & FILE_RESTORED))
 	{
-		// Divide part into segments (1 segment per thread)
-		unsigned long long seg_size = size / thread_count;
-		segments_.resize(thread_count);
-		unsigned long long seg_offset = 0;
-		for (unsigned i = 0; i < thread_count; i++, seg_offset += seg_size) 
-		{
-			WebFileSegment *seg;
-			seg = new WebFileSegment(this, url_, 
-				offset + seg_offset, i == thread_count - 1 ? size - seg_offset : seg_size, 
-				pause_event_, continue_event_, stop_event_);
-			seg->Start();
-			segments_[i] = seg;
-		}
+		segments_.resize(0);
+		next_offset_ = 0;
+		ResetHash();
 	}
 	else
 	{
-		// Launch restored segments
-		for (unsigned i = 0; i < thread_count; i++) 
-			(segments_[i])->Start();
 		flags_ &= ~FILE_RESTORED;
+		// Size has not been received before the state was saved; start over
+		if (!size_known_)
+		{
+			for (size_t i = 0; i < segments_.size(); i++)
+				delete segments_[i];
+			segments_.resize(0);
+			next_offset_ = 0;
+			ResetHash();
+		}
+		if (next_offset_ > file_size_)
+			next_offset_ = file_size_;
+		// Finished segments are not needed anymore. Hedged ranges end 
+		// at the same offset; the one which is ahead is kept.
+		for (size_t i = 0; i < segments_.size(); )
+		{
+			bool overtaken = false;
+			unsigned long long end = segments_[i]->GetSegOffset() + segments_[i]->GetSize();
+			for (size_t j = 0; j < segments_.size() && !overtaken; j++)
+			{
+				if (j != i 
+					&& end == segments_[j]->GetSegOffset() + segments_[j]->GetSize()
+					&& (segments_[j]->GetRemainingSize() < segments_[i]->GetRemainingSize()
+						|| (segments_[j]->GetRemainingSize() == segments_[i]->GetRemainingSize() && j < i)))
+					overtaken = true;
+			}
+			if (0 == segments_[i]->GetRemainingSize() || overtaken)
+			{
+				delete segments_[i];
+				segments_.erase(segments_.begin() + i);
+			}
+			else
+				i++;
+		}
 	}
 
-	thread_handles_.resize(thread_count);
-	for (unsigned i = 0; i < thread_count; i++) 
-		thread_handles_[i] = segments_[i]->GetThreadHandle();
+	// Segments are driven by transfer engine; wait until all of them are done
+	download_failed_ = false;
+	if (preallocate_ && size_known_ && !Preallocate())
+	{
+		file_error_ = STATUS_NO_DISK_SPACE;
+		download_failed_ = true;
+	}
+	else if (size_known_)
+		MapFile();
+	downloading_ = true;
+	ResetEvent(segments_done_event_);
+	ScheduleSegments(false);
 
 	Unlock(&lock_);
 
-	WaitForMultipleObjects(thread_count, &thread_handles_[0], TRUE, INFINITE);
-
-	for (unsigned i = 0; i < thread_count; i++) 
+	// Ranges waiting for retry are started from here if there are no active 
+	// segments to schedule them from engine thread
+	while (WAIT_TIMEOUT == WaitForSingleObject(segments_done_event_, RETRY_CHECK_PERIOD))
 	{
-		WebFileSegment *seg = segments_[i];
-		if (seg->GetStatus() == STATUS_DOWNLOAD_FAILURE)
-			SetStatus(STATUS_DOWNLOAD_FAILURE);
-		delete seg;
+		Lock(&lock_);
+		if (!terminating_)
+			ScheduleSegments(false);
+		Unlock(&lock_);
+		// Hashing keeps up with the download, so committed data are not 
+		// read back from disk after it
+		while (HashCommittedData(HASH_STEP_SIZE))
+			;
 	}
 
-	segments_.resize(0);
-	thread_handles_.resize(0);
+	// The rest of the file is hashed once it is written. Ranges which 
+	// have failed to be written are kept in state and downloaded again.
+	WaitForWrites();
+	Lock(&lock_);
+	DeleteRetiredSegments();
+	RecoverWriteErrors();
+	Unlock(&lock_);
+	HashCommittedData(file_size_);
 
-	return true;
+	// Failed segments are kept to be saved in download state. 
+	// Ranges left by user stop are not a failure.
+	Lock(&lock_);
+	downloading_ = false;
+	if (file_error_)
+		SetStatus(file_error_);
+	else if ((!segments_.empty() || next_offset_ < file_size_) 
+		&& STATUS_DOWNLOAD_STOPPED != download_status_)
+		SetStatus(STATUS_DOWNLOAD_FAILURE);
+	Unlock(&lock_);
+
+	return STATUS_DOWNLOAD_FAILURE != download_status_ 
+		&& STATUS_DOWNLOAD_STOPPED != download_status_ && !file_error_;
 }
 
 void WebFile::GetDownloadStatus(__out unsigned int& status, 
@@ -234,11 +1329,32 @@ void WebFile::GetDownloadStatus(__out unsigned int& status,
 								__out unsigned long long& increment)
 {
 	status = download_status_;
+	downloaded_size = AtomicRead64(&downloaded_size_);
+	increment = AtomicExchange64(&increment_, 0);
+	// Only this thread decreases recounted_size_
+	unsigned long long recounted = min(increment, AtomicRead64(&recounted_size_));
+	AtomicAdd64(&recounted_size_, 0 - recounted);
+	increment -= recounted;
+}
+
+unsigned int WebFile::GetErrorCount()
+{
 	Lock(&lock_);
-	downloaded_size = downloaded_size_;
-	increment = increment_;
-	increment_ = 0;
+	unsigned int error_count = error_count_;
+	error_count_ = 0;
 	Unlock(&lock_);
+	return error_count;
+}
+
+unsigned long long WebFile::GetDownloadedSize()
+{
+	return AtomicRead64(&downloaded_size_);
+}
+
+void WebFile::Uncount(unsigned long long size)
+{
+	AtomicAdd64(&downloaded_size_, 0 - min(size, AtomicRead64(&downloaded_size_)));
+	AtomicAdd64(&recounted_size_, size);
 }
 
 void WebFile::SetStatus(unsigned int status)
@@ -2,6 +2,7 @@
 #define _FILE_H_
 
 #include "common/types.h"
+#include "engine/digest.h"
 #include <list>
 #include <boost/serialization/list.hpp>
 #include <boost/serialization/string.hpp>
@@ -10,16 +11,17 @@
 #include <boost/serialization/split_member.hpp>
 
 class WebFileSegment;
-
-#define FILE_THREAD_COUNT_CHANGED 0x00000001 // Thread count has been changed and
-											 // re-download should be performed for current part
+class TransferEngine;
+class RateLimiter;
+class DiskWriter;
 
 #define FILE_RESTORED             0x00000002 // File has been restored from serialized state
 
 class WebFile
 {
 public:
-	WebFile(const std::string &url, const StlString& fname, 
+	WebFile(TransferEngine *engine, RateLimiter *limiter, 
+		const std::string &url, const StlString& fname, 
 		unsigned int thread_count,
 		HANDLE pause_event, HANDLE continue_event, HANDLE stop_event);
 
@@ -27,7 +29,8 @@ public:
 		unsigned int thread_count,
 		HANDLE pause_event, HANDLE continue_event, HANDLE stop_event);
 
-	WebFile(HANDLE pause_event, HANDLE continue_event, HANDLE stop_event);
+	WebFile(TransferEngine *engine, RateLimiter *limiter, 
+		HANDLE pause_event, HANDLE continue_event, HANDLE stop_event);
 
 	virtual ~WebFile();
 
@@ -38,7 +41,14 @@ public:
 	std::string GetUrl() { return url_; }
 
 	/**
-	 *	Update thread count; restart currently downloaded part.
+	 *	Set equivalent URL-s of the file (besides the main one). 
+	 *	Must be called before Start().
+	 */
+	void SetMirrors(const std::list<std::string>& mirror_list);
+
+	/**
+	 *	Update thread count. Ranges in flight are not restarted: connections
+	 *	are added by splitting them, or removed as their ranges finish.
 	 */
 	void UpdateThreadCount(unsigned int thread_count);
 
@@ -52,20 +62,147 @@ public:
 
 	unsigned long long GetSize() { return file_size_; }
 
+	unsigned long long GetDownloadedSize();
+
+	unsigned int GetThreadCount() { return thread_count_; }
+
+	/**
+	 *	Number of failed ranges since the previous call.
+	 */
+	unsigned int GetErrorCount();
+
 	void Down() { Lock(&lock_); }
 	void Up() { Unlock(&lock_); }
 
+	TransferEngine *GetEngine() { return engine_; }
+
+	RateLimiter *GetRateLimiter() { return limiter_; }
+
+	/**
+	 *	Received data are collected by every segment into a buffer taken from
+	 *	disk writer, and written by its thread. NULL (or writer which is not
+	 *	started) disables buffering: data are written from engine thread.
+	 *	Must be called before Start().
+	 */
+	void SetDiskWriter(DiskWriter *writer);
+
+	/**
+	 *	Reserve disk space for the whole file as soon as its size is known,
+	 *	so the file is not extended by scattered writes. Download fails with
+	 *	STATUS_NO_DISK_SPACE if the space is not available.
+	 *	Must be called before Start().
+	 */
+	void SetPreallocate(bool preallocate);
+
+	/**
+	 *	Output backend, WRITE_MODE_XXX. In WRITE_MODE_MAPPED received data 
+	 *	are copied to views of file mapping around segment positions; dirty 
+	 *	pages are flushed by FlushBuffers(). Falls back to WRITE_MODE_FILE 
+	 *	if the file can not be mapped. In WRITE_MODE_DIRECT whole pages of 
+	 *	buffers are written bypassing system cache; requires disk writer.
+	 *	Must be called before Start().
+	 */
+	void SetWriteMode(unsigned int write_mode);
+
+	/**
+	 *	Ask segments to write their buffers. Buffers are flushed by engine 
+	 *	thread on the next tick; saved state covers flushed data only.
+	 */
+	void FlushBuffers();
+
+	/**
+	 *	Digest algorithm of the manifest (DIGEST_XXX) and its part size;
+	 *	MD5 of PART_SIZE parts by default. If they differ from the ones of
+	 *	restored state, the file is read to be verified. 
+	 *	Must be called before Start().
+	 */
+	void SetDigestParameters(unsigned int digest_type, unsigned long long part_size);
+
+	/**
+	 *	Download the given ranges of the file which has been downloaded
+	 *	already (e.g. parts which have not matched their digests); the rest
+	 *	of the file is kept. Must be called before Start().
+	 *	@param ranges	Offsets and sizes of ranges
+	 */
+	void SetRepairRanges(unsigned long long file_size, 
+						 const std::list<std::pair<unsigned long long, unsigned long long> >& ranges);
+
+	/**
+	 *	Digests of parts and of the whole file, computed while 
+	 *	the file is downloaded.
+	 *	@return false if digests are not complete (e.g. state has been saved 
+	 *	by previous version); the file must be read to verify it then
+	 */
+	bool GetDigests(__out std::vector<std::string>& part_digests, __out std::string& file_digest);
+
 protected:
 
 	/**
 	 *	Download notify callbacks. Called from WebFileSegment-s.
-	 *	These methods are thread-safe.
+	 *	These methods are thread-safe. NotifyDownloadProgress() is called 
+	 *	from engine thread only and does not take lock_; it returns false 
+	 *	if the data have not been written.
 	 */
 
-	void NotifyDownloadProgress(WebFileSegment *sender, 
+	bool NotifyDownloadProgress(WebFileSegment *sender, 
 								unsigned long long offset, 
 								void *data, size_t size);
 
+	void NotifySegmentDone(WebFileSegment *sender);
+
+	/**
+	 *	File size has been received by sender. The first response sets 
+	 *	the size and remaining ranges are scheduled; the next ones must match it.
+	 *	@return false if size differs from the known one
+	 */
+	bool NotifyFileSize(WebFileSegment *sender, unsigned long long size, bool range_supported);
+
+	void NotifyTick(); // Called periodically from engine thread by active segments
+
+	/**
+	 *	Write-behind buffers of segments. Called from engine thread,
+	 *	or for a segment which is not attached to engine.
+	 *	ReserveBuffer() returns false if all buffers of disk writer are 
+	 *	queued; the transfer must be paused then. BufferData() and WriteAt() 
+	 *	return false if data which are written at once have failed.
+	 */
+	bool ReserveBuffer(WebFileSegment *seg, size_t size);
+	bool BufferData(WebFileSegment *seg, unsigned long long offset, void *data, size_t size);
+	void FlushBuffer(WebFileSegment *seg);
+	bool WriteAt(unsigned long long offset, void *data, size_t size);
+	size_t GetBufferSkew(unsigned long long offset);
+
+	/**
+	 *	Mapped backend. MapFile() is called when the file size is known, 
+	 *	before data are written; lock_ MUST be held. Every segment maps 
+	 *	its own view; the view is moved when segment position leaves it.
+	 */
+	void MapFile();
+	bool WriteMapped(WebFileSegment *seg, unsigned long long offset, void *data, size_t size);
+	void UnmapView(WebFileSegment *seg);
+
+	bool HasFreeBuffer();
+
+	/**
+	 *	Wait until buffers submitted to disk writer are written.
+	 */
+	void WaitForWrites();
+
+	bool Preallocate(); // Called before data are written
+
+	/**
+	 *	Inline hashing. Committed data (the prefix of the file which has been 
+	 *	flushed by all segments) are read back and hashed by file thread 
+	 *	while the download is in progress; they are in system cache yet. 
+	 *	WRITE_MODE_DIRECT bypasses the cache, so its data are read from disk 
+	 *	once more; the reads overlap the download instead of following it. 
+	 *	Hash state is saved along with the segments and covers committed 
+	 *	data only, so the hashing is resumed with the download.
+	 */
+	unsigned long long GetCommittedSize(); // lock_ MUST be held
+	bool HashCommittedData(unsigned long long max_size); // Returns true if committed data are left
+	void ResetHash(); // lock_ MUST be held
+
 	bool GetDownloadParameters(__out bool& updated);
 
 private:
@@ -75,14 +212,17 @@ private:
 	unsigned int thread_count_;
 	unsigned long long file_size_;
 	std::vector <WebFileSegment *> segments_;
+	std::vector <WebFileSegment *> retired_segments_; // Deleted segments with writes pending
 	unsigned int flags_;
 
-	size_t part_num_;
+	// Bytes below next_offset_ which are not covered by segments_ are downloaded
+	unsigned long long next_offset_;
 
 	unsigned int download_status_;
 
-	unsigned long long downloaded_size_; // lock_ MUST be held when accessing this member
-	unsigned long long increment_;
+	unsigned long long downloaded_size_; // Updated atomically
+	unsigned long long increment_;       // Updated atomically
+	unsigned long long recounted_size_;  // Bytes counted twice; taken off the next increments
 
 	friend class WebFileSegment;
 
@@ -90,15 +230,101 @@ private:
 	HANDLE continue_event_;
 	HANDLE stop_event_;
 
-	HANDLE file_handle_; // lock_ MUST be held when accessing this file
+	HANDLE file_handle_; // Written at absolute offsets from engine thread
+	HANDLE direct_handle_; // Unbuffered handle of WRITE_MODE_DIRECT, or INVALID_HANDLE_VALUE
 	HANDLE thread_handle_;
 
-	std::vector<HANDLE> thread_handles_;
+	TransferEngine *engine_;
+	RateLimiter *limiter_;
+
+	unsigned int error_count_;   // lock_ MUST be held when accessing this member
+	bool download_failed_;       // One of segments has failed
+	bool downloading_;           // Download() is in progress
+	bool terminating_;
+	bool size_known_;            // file_size_ has been received
+	bool single_stream_;         // Server ignores Range; the file is downloaded by one connection
+	volatile LONG reschedule_;   // Thread count has been changed; schedule segments from engine thread
+	DiskWriter *writer_;
+	bool preallocate_;
+	unsigned int write_mode_;
+	HANDLE mapping_handle_;      // File mapping of WRITE_MODE_MAPPED, or NULL
+	unsigned int file_error_;    // Status to report if the file itself has failed
+	volatile LONG flush_epoch_;  // Incremented by FlushBuffers()
+	HANDLE segments_done_event_; // Set when there are no active segments left
+
+	// Inline hash state. Updated by file thread; lock_ MUST be held when accessing it
+	unsigned int digest_type_;            // DIGEST_XXX
+	unsigned long long part_size_;
+	unsigned long long hashed_offset_;
+	std::string part_state_;              // Part which contains hashed_offset_; empty if not started
+	std::string file_state_;              // Not used by tree digests
+	std::list<std::string> part_digests_; // Digests of finished parts
+	bool hash_valid_;
+	BYTE *hash_buffer_;                   // File thread only
+
+	/**
+	 *	Equivalent source of the file. Ranges are assigned to mirrors
+	 *	proportionally to their throughput; mirrors which fail or stall
+	 *	are not used for a while.
+	 */
+	struct Mirror {
+		std::string url_;
+		unsigned long long received_; // Bytes received since the last throughput sample; engine thread only
+		double throughput_;           // Smoothed throughput per connection, bytes/msec (0 if not measured)
+		unsigned int active_count_;   // Segments downloaded from this mirror
+		unsigned int error_count_;    // Errors in a row
+		DWORD demote_start_;
+		DWORD demote_period_;
+	};
+
+	std::vector <Mirror> mirrors_; // Mirror 0 is url_. lock_ MUST be held when accessing this member
+	DWORD sample_start_;
+
+	/**
+	 *	Mirror selection and statistics.
+	 *	lock_ MUST be held when calling these methods.
+	 */
+	int SelectMirror(int avoid = -1); // Returns -1 if all mirrors are demoted
+	void DemoteMirror(unsigned int mirror);
+	void SampleThroughput();
 
 	static unsigned __stdcall FileThread(void *arg);
 
-	bool DownloadPart(size_t part_num, unsigned long long offset, 
-					  unsigned long long size, unsigned int thread_count);
+	bool Download();
+
+	/**
+	 *	Range scheduler. Launches queued segments while there are free 
+	 *	connections; if nothing is queued, takes the next range of the file;
+	 *	if the whole file is assigned, splits the largest remaining range 
+	 *	and hands its tail to the free connection.
+	 *	lock_ MUST be held when calling these methods.
+	 */
+	void ScheduleSegments(bool split_active);
+	WebFileSegment *CreateNextSegment();
+	WebFileSegment *SplitLargestSegment(bool split_active);
+	unsigned long long GetNextSegmentSize();
+
+	/**
+	 *	End-game mode: when no range can be split, duplicate the tail of 
+	 *	the range which is expected to finish last. Bytes are taken from 
+	 *	whichever segment delivers them first; the loser is cancelled.
+	 */
+	WebFileSegment *HedgeSlowestSegment();
+	void DeleteSegment(WebFileSegment *seg);
+	void DeleteRetiredSegments();
+
+	/**
+	 *	Bytes which are downloaded once more are taken off progress counters.
+	 */
+	void Uncount(unsigned long long size);
+
+	/**
+	 *	Data which disk writer has failed to write are downloaded again 
+	 *	from the last flushed byte of the segment. Segments are rewound 
+	 *	once their writes are completed.
+	 */
+	void RewindSegment(WebFileSegment *seg);
+	void RecoverWriteErrors();
 
 	void SetStatus(unsigned int status);
 
@@ -110,39 +336,93 @@ private:
 	{
 		ar & url_;
 		ar & fname_;
-		unsigned int seg_size = (unsigned int)segments_.size();
+		// Retired segments are saved until their data are written
+		unsigned int seg_size = (unsigned int)(segments_.size() + retired_segments_.size());
 		ar & seg_size;
 		ar & file_size_;
 		ar & download_status_;
-		ar & downloaded_size_;
-		ar & part_num_;
+		unsigned long long downloaded_size = AtomicRead64(&downloaded_size_);
+		ar & downloaded_size;
+		ar & next_offset_;
+		ar & thread_count_;
 		for (size_t i = 0; i < segments_.size(); i++) 
 			ar & *(segments_[i]);
+		for (size_t i = 0; i < retired_segments_.size(); i++) 
+			ar & *(retired_segments_[i]);
+		ar & hash_valid_;
+		ar & hashed_offset_;
+		ar & part_state_;
+		ar & file_state_;
+		ar & part_digests_;
+		ar & digest_type_;
+		ar & part_size_;
 	}
 	template<class Archive>
 	void load(Archive & ar, const unsigned int version)
 	{
-		if (version > 0)
+		if (version > 5)
 			return;
 		ar & url_;
 		ar & fname_;
-		ar & thread_count_;
+		unsigned int seg_size;
+		ar & seg_size;
 		ar & file_size_;
 		unsigned int status;
 		ar & status;
 		SetStatus(status); // download_status_ should be set atomically
 		ar & downloaded_size_;
-		ar & part_num_;
+		if (version > 1)
+			ar & next_offset_;
+		else
+		{
+			size_t part_num; // Files were downloaded part by part
+			ar & part_num;
+		}
+		// Segments are split dynamically, so their number may differ from thread count
+		if (version > 0)
+			ar & thread_count_;
+		else
+			thread_count_ = seg_size;
 		flags_ = FILE_RESTORED;
-		segments_.resize(thread_count_);
+		size_known_ = true;
+		segments_.resize(seg_size);
 		for (size_t i = 0; i < segments_.size(); i++) 
 		{
 			segments_[i] = new WebFileSegment(this, url_, 
 							pause_event_, continue_event_, stop_event_);
 			ar & *(segments_[i]);
+			// State was saved before the first response
+			if (!segments_[i]->IsSizeKnown())
+				size_known_ = false;
+			if (version < 2)
+			{
+				// Everything after the restored part has not been assigned yet
+				unsigned long long seg_end = 
+					segments_[i]->GetSegOffset() + segments_[i]->GetSize();
+				if (seg_end > next_offset_)
+					next_offset_ = seg_end;
+			}
 		}
+		// Files saved by previous versions are read to be verified
+		hash_valid_ = false;
+		if (version > 2)
+		{
+			ar & hash_valid_;
+			ar & hashed_offset_;
+			ar & part_state_;
+			ar & file_state_;
+			ar & part_digests_;
+		}
+		digest_type_ = DIGEST_MD5;
+		if (version > 3)
+			ar & digest_type_;
+		// Constructor sets the default part size for previous versions
+		if (version > 4)
+			ar & part_size_;
 	}
 	BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
 
+BOOST_CLASS_VERSION(WebFile, 5)
+
 #endif
@@ -1,7 +1,9 @@
 #include <windows.h>
 #include <tchar.h>
-#include <process.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <string>
 #include <vector>
 #include <list>
@@ -11,9 +13,24 @@ using namespace std;
 
 #include "engine/webfilesegment.h"
 #include "engine/webfile.h"
+#include "engine/diskwriter.h"
 #include "common/consts.h"
 #include "common/logging.h"
 #include "common/misc.h"
+#include "common/httppool.h"
+#include "common/redirectcache.h"
+
+// Connection which has not received any data for this period is dropped, msec
+#define SEGMENT_STALL_TIMEOUT (30 * 1000)
+
+// Failed transfer is retried after RETRY_BASE_DELAY, the delay is doubled
+// for every failure in a row up to RETRY_MAX_DELAY, msec
+#define RETRY_BASE_DELAY 1000
+#define RETRY_MAX_DELAY  (60 * 1000)
+#define MAX_RETRY_COUNT  8
+
+// The same limit as for metadata requests
+#define MAX_REDIRECTS 500
 
 WebFileSegment::WebFileSegment(WebFile *file, 
 							   const std::string& url, 
@@ -26,9 +43,37 @@ WebFileSegment::WebFileSegment(WebFile *file,
  size_(size), pause_event_(pause_event), 
  continue_event_(continue_event), stop_event_(stop_event)
 {
-	thread_ = NULL;
+	http_handle_ = NULL;
+	headers_ = NULL;
+	err_buffer_ = NULL;
+	active_ = false;
+	paused_ = false;
+	throttled_ = false;
+	mirror_ = 0;
+	last_data_tick_ = 0;
+	retry_count_ = 0;
+	retry_start_ = 0;
+	retry_delay_ = 0;
+	attempt_size_ = 0;
+	start_tick_ = 0;
+	response_code_ = 0;
+	total_size_ = SEGMENT_SIZE_UNKNOWN;
+	content_length_ = SEGMENT_SIZE_UNKNOWN;
+	response_checked_ = false;
+	peer_ = NULL;
 	downloaded_size_ = 0;
-	cached_downloaded_size_ = 0;
+	flushed_size_ = 0;
+	buffer_ = NULL;
+	buffer_used_ = 0;
+	buffer_offset_ = 0;
+	buffer_skew_ = 0;
+	pending_writes_ = 0;
+	write_error_ = 0;
+	flush_epoch_ = 0;
+	write_blocked_ = false;
+	view_ = NULL;
+	view_offset_ = 0;
+	view_size_ = 0;
 	SetStatus(STATUS_DOWNLOAD_NOT_STARTED);
 }
 
@@ -41,39 +86,232 @@ WebFileSegment::WebFileSegment(class WebFile *file,
  size_(0), pause_event_(pause_event), 
  continue_event_(continue_event), stop_event_(stop_event)
 {
-	thread_ = NULL;
+	http_handle_ = NULL;
+	headers_ = NULL;
+	err_buffer_ = NULL;
+	active_ = false;
+	paused_ = false;
+	throttled_ = false;
+	mirror_ = 0;
+	last_data_tick_ = 0;
+	retry_count_ = 0;
+	retry_start_ = 0;
+	retry_delay_ = 0;
+	attempt_size_ = 0;
+	start_tick_ = 0;
+	response_code_ = 0;
+	total_size_ = SEGMENT_SIZE_UNKNOWN;
+	content_length_ = SEGMENT_SIZE_UNKNOWN;
+	response_checked_ = false;
+	peer_ = NULL;
 	downloaded_size_ = 0;
-	cached_downloaded_size_ = 0;
+	flushed_size_ = 0;
+	buffer_ = NULL;
+	buffer_used_ = 0;
+	buffer_offset_ = 0;
+	buffer_skew_ = 0;
+	pending_writes_ = 0;
+	write_error_ = 0;
+	flush_epoch_ = 0;
+	write_blocked_ = false;
+	view_ = NULL;
+	view_offset_ = 0;
+	view_size_ = 0;
 	SetStatus(STATUS_DOWNLOAD_NOT_STARTED);
 }
 
 WebFileSegment::~WebFileSegment()
 {
-	if (thread_)
-		CloseHandle(thread_);
+	Terminate();
+	Cleanup();
+	if (buffer_)
+		file_->writer_->ReleaseBuffer(buffer_);
+	file_->UnmapView(this);
 }
 
+/**
+ *	Prepare HTTP request for the rest of segment and pass it to transfer engine.
+ *	WebFile is notified via NotifySegmentDone() when the transfer is finished.
+ */
 bool WebFileSegment::Start()
 {
-	unsigned thread_id;
-	thread_ = (HANDLE)_beginthreadex(NULL, 0, FileSegmentThread, this, 0, &thread_id);
-	return thread_ != NULL;
+	flush_epoch_ = file_->flush_epoch_;
+
+	// Redirect chain of the mirror is followed by the first request only;
+	// the rest of segments and retries go to its target directly
+	request_url_ = ResolveUrl(url_);
+	http_handle_ = AcquireHttpHandle(request_url_);
+	if (!http_handle_)
+	{
+		SetStatus(STATUS_INIT_FAILED);
+		return false;
+	}
+
+	// Set HTTP options
+	curl_easy_setopt(http_handle_, CURLOPT_URL, request_url_.c_str());
+	curl_easy_setopt(http_handle_, CURLOPT_MAXREDIRS, MAX_REDIRECTS);
+	curl_easy_setopt(http_handle_, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(http_handle_, CURLOPT_WRITEFUNCTION, DownloadWriteDataCallback);
+	curl_easy_setopt(http_handle_, CURLOPT_WRITEDATA, this);
+	curl_easy_setopt(http_handle_, CURLOPT_HEADERFUNCTION, HeaderCallback);
+	curl_easy_setopt(http_handle_, CURLOPT_WRITEHEADER, this);
+	curl_easy_setopt(http_handle_, CURLOPT_VERBOSE, 1);
+	curl_easy_setopt(http_handle_, CURLOPT_DEBUGFUNCTION, DebugCallback);
+	curl_easy_setopt(http_handle_, CURLOPT_DEBUGDATA, this);
+	// Error pages of mirrors must not be written to the file. The response 
+	// for the first range is checked by CheckResponse() only: empty file 
+	// is reported by 416 which is accepted there.
+	curl_easy_setopt(http_handle_, CURLOPT_FAILONERROR, IsSizeKnown() ? 1 : 0);
+	SetProxyForHttpHandle(http_handle_);
+
+	err_buffer_ = (char*)malloc(CURL_ERROR_SIZE);
+	if (err_buffer_)
+	{
+		err_buffer_[0] = '\0';
+		curl_easy_setopt(http_handle_, CURLOPT_ERRORBUFFER, err_buffer_);
+	}
+
+	// Set file position. The end of the first segment is not known
+	// until the file size is received.
+	CHAR range_header[1024];
+	ULONG64 range_start = seg_offset_ + downloaded_size_;
+	if (SEGMENT_SIZE_UNKNOWN == size_)
+		_snprintf(range_header, _countof(range_header), "Range: bytes=%lld-", range_start);
+	else
+		_snprintf(range_header, _countof(range_header), "Range: bytes=%lld-%lld", 
+			range_start, seg_offset_ + size_ - 1);
+	headers_ = curl_slist_append(headers_, range_header);
+	if (!headers_)
+	{
+		Cleanup();
+		SetStatus(STATUS_INIT_FAILED);
+		return false;
+	}
+	curl_easy_setopt(http_handle_, CURLOPT_HTTPHEADER, headers_);
+
+	attempt_size_ = downloaded_size_;
+	start_tick_ = GetTickCount();
+	response_code_ = 0;
+	total_size_ = SEGMENT_SIZE_UNKNOWN;
+	content_length_ = SEGMENT_SIZE_UNKNOWN;
+	response_checked_ = false;
+	file_key_ = file_->GetUrl();
+	host_key_ = GetHostKey(request_url_);
+
+	SetStatus(STATUS_DOWNLOAD_STARTED);
+	paused_ = false;
+	throttled_ = false;
+	write_blocked_ = false;
+	last_data_tick_ = GetTickCount();
+	active_ = true;
+	file_->GetEngine()->Add(this);
+	return true;
 }
 
-void WebFileSegment::Restart()
+bool WebFileSegment::Terminate()
 {
-	WaitForSingleObject(thread_, INFINITE);
-	Start();
+	if (!active_)
+		return false;
+	file_->GetEngine()->Remove(this);
+	file_->GetRateLimiter()->Cancel(this);
+	file_->Down();
+	active_ = false;
+	file_->Up();
+	// Segment is detached from engine; its buffer is not accessed by anyone else
+	file_->FlushBuffer(this);
+	file_->UnmapView(this);
+	return true;
 }
 
-bool WebFileSegment::IsFinished()
+bool WebFileSegment::ScheduleRetry()
 {
-	return WAIT_OBJECT_0 == WaitForSingleObject(thread_, 0);
+	// Long transfer which has been reset is not penalized for previous failures.
+	// Data which have not been written to disk do not count.
+	if (downloaded_size_ > attempt_size_ && !write_error_)
+		retry_count_ = 0;
+	if (++retry_count_ > MAX_RETRY_COUNT)
+		return false;
+
+	DWORD delay = RETRY_BASE_DELAY << (retry_count_ - 1);
+	if (delay > RETRY_MAX_DELAY)
+		delay = RETRY_MAX_DELAY;
+	// Equal jitter: segments failed at once are not retried at once
+	retry_delay_ = delay / 2 + (DWORD)(rand() % (delay / 2 + 1));
+	retry_start_ = GetTickCount();
+
+	LOG(("[ScheduleRetry] offset=0x%llx, retry_count=%u, delay=%u\n", 
+		seg_offset_ + downloaded_size_, retry_count_, retry_delay_));
+	return true;
 }
 
-bool WebFileSegment::Terminate()
+bool WebFileSegment::IsRetryDue()
 {
-	return 0 != TerminateThread(thread_, 0);
+	return 0 == retry_count_ || GetTickCount() - retry_start_ >= retry_delay_;
+}
+
+bool WebFileSegment::CheckResponse()
+{
+	// Server which ignores Range sends the whole file; 
+	// its data are only usable from the beginning of the file
+	unsigned long long range_start = seg_offset_ + downloaded_size_;
+	unsigned long long total_size;
+	bool range_supported = (206 == response_code_);
+	if (416 == response_code_ && 0 == total_size_ && 0 == range_start)
+	{
+		// "Content-Range: bytes */0": no range is satisfiable in empty file
+		total_size = 0;
+		range_supported = true;
+	}
+	else if (range_supported)
+		total_size = total_size_;
+	else if (200 == response_code_ && 0 == range_start)
+		total_size = content_length_;
+	else
+	{
+		LOG(("[CheckResponse] Unexpected response %u, offset=0x%llx\n", response_code_, range_start));
+		return false;
+	}
+	// Empty file may be sent without Content-Range
+	if (SEGMENT_SIZE_UNKNOWN == total_size && 0 == content_length_ && 0 == range_start)
+		total_size = 0;
+	if (SEGMENT_SIZE_UNKNOWN == total_size)
+	{
+		LOG(("[CheckResponse] File size is not sent, offset=0x%llx\n", range_start));
+		return false;
+	}
+	// Segments scheduled for the rest of the file use the target at once
+	StoreRedirectTarget(url_, http_handle_);
+	return file_->NotifyFileSize(this, total_size, range_supported);
+}
+
+void WebFileSegment::Shrink(unsigned long long size)
+{
+	assert(size >= downloaded_size_ && size <= size_);
+	size_ = size;
+}
+
+void WebFileSegment::Cleanup()
+{
+	if (throttled_)
+	{
+		file_->GetRateLimiter()->Cancel(this);
+		throttled_ = false;
+	}
+	if (headers_)
+	{
+		curl_slist_free_all(headers_);
+		headers_ = NULL;
+	}
+	if (http_handle_)
+	{
+		ReleaseHttpHandle(request_url_, http_handle_);
+		http_handle_ = NULL;
+	}
+	if (err_buffer_)
+	{
+		free(err_buffer_);
+		err_buffer_ = NULL;
+	}
 }
 
 void WebFileSegment::SetStatus(unsigned int status)
@@ -87,23 +325,86 @@ size_t WebFileSegment::DownloadWriteDataCallback(void *buffer, size_t size, size
 	if (WAIT_OBJECT_0 == WaitForSingleObject(seg->stop_event_, 0))
 	{
 		seg->file_->SetStatus(STATUS_DOWNLOAD_STOPPED);
+		seg->file_->FlushBuffer(seg);
+		return 0;
+	}
+	if (seg->write_error_)
+	{
+		// Range is downloaded again from the last flushed byte, see WebFile::RewindSegment()
+		seg->file_->FlushBuffer(seg);
 		return 0;
 	}
+	if (!seg->response_checked_)
+	{
+		// Error page or a response for another file must not be written
+		if (!seg->CheckResponse())
+			return 0;
+		seg->response_checked_ = true;
+	}
 	if (WAIT_OBJECT_0 == WaitForSingleObject(seg->pause_event_, 0))
+	{
+		seg->paused_ = true;
+		seg->file_->FlushBuffer(seg);
 		return CURL_WRITEFUNC_PAUSE;
-
-	InterlockedExchange(
-		(volatile LONG*)&seg->cached_downloaded_size_, (LONG)seg->downloaded_size_);
+	}
+	if (!seg->file_->ReserveBuffer(seg, nmemb * size))
+	{
+		// Disk does not keep up; resumed from OnTick() when a buffer is written
+		seg->write_blocked_ = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	RateLimiter *limiter = seg->file_->GetRateLimiter();
+	if (!limiter->Acquire(seg, seg->file_key_, seg->host_key_))
+	{
+		// cURL keeps the data and passes them again when transfer is resumed
+		seg->throttled_ = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	limiter->Consume(seg->file_key_, seg->host_key_, nmemb * size);
+	seg->last_data_tick_ = GetTickCount();
 
 	size_t nr_write = nmemb * size;
+	// Segment could be shrunk after the request was sent; drop the data beyond its end
+	if (nr_write > seg->GetRemainingSize())
+		nr_write = (size_t)seg->GetRemainingSize();
 	ULONG64 position = seg->seg_offset_ + seg->downloaded_size_;
 	LOG(("[DownloadWriteDataCallback] tid=0x%x, position=0x%llx, size=0x%x\n", 
 		GetCurrentThreadId(), position, nr_write));
-	seg->file_->NotifyDownloadProgress(seg, position, buffer, nr_write);
-	seg->downloaded_size_ += nr_write;
+	// Data which have not been written abort the transfer; the segment is retried
+	if (nr_write && !seg->file_->NotifyDownloadProgress(seg, position, buffer, nr_write))
+		return 0;
+	if (nr_write < nmemb * size)
+		return nr_write; // End of segment reached; abort transfer
 	return nmemb;		 
 }
 
+size_t WebFileSegment::HeaderCallback(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+	WebFileSegment *seg = (WebFileSegment*)userp;
+	string header_str((char*)buffer, size * nmemb);
+	const string range_header_str = "content-range:";
+	const string length_header_str = "content-length:";
+
+	if (0 == header_str.compare(0, 5, "HTTP/"))
+	{
+		// Status line, e.g. "HTTP/1.1 206 Partial Content"
+		size_t pos = header_str.find(' ');
+		seg->response_code_ = (-1 != pos) ? atoi(header_str.c_str() + pos + 1) : 0;
+		seg->total_size_ = SEGMENT_SIZE_UNKNOWN;
+		seg->content_length_ = SEGMENT_SIZE_UNKNOWN;
+	}
+	else if (0 == _strnicmp(header_str.c_str(), range_header_str.c_str(), range_header_str.size()))
+	{
+		// "Content-Range: bytes 0-1023/146515"; total size may be sent as "*"
+		size_t pos = header_str.find('/');
+		if (-1 != pos && pos + 1 < header_str.size() && isdigit((unsigned char)header_str[pos + 1]))
+			seg->total_size_ = _strtoui64(header_str.c_str() + pos + 1, NULL, 10);
+	}
+	else if (0 == _strnicmp(header_str.c_str(), length_header_str.c_str(), length_header_str.size()))
+		seg->content_length_ = _strtoui64(header_str.c_str() + length_header_str.size(), NULL, 10);
+	return nmemb;
+}
+
 int WebFileSegment::DebugCallback(CURL *handle, curl_infotype type, char *data, size_t size, void *userptr)
 {
 	if (type != CURLINFO_DATA_IN && type != CURLINFO_DATA_OUT)
@@ -113,97 +414,88 @@ int WebFileSegment::DebugCallback(CURL *handle, curl_infotype type, char *data,
 	return 0;
 }
 
-int WebFileSegment::ProgressCallback(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow)
+/**
+ *	Paused transfers are not polled by cURL, so they are resumed from here.
+ *	Stalled transfers are aborted; WebFile restarts the range from another mirror.
+ *	Also gives WebFile a chance to reschedule segments and rate limiter
+ *	a chance to resume throttled transfers from engine thread.
+ */
+bool WebFileSegment::OnTick()
 {
-	WebFileSegment *seg = (WebFileSegment*)clientp;
-	HANDLE event_handles[2];
-	event_handles[0] = seg->continue_event_;
-	event_handles[1] = seg->stop_event_;
-	DWORD wait_result = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, 0);
-	if (WAIT_OBJECT_0 == wait_result || WAIT_OBJECT_0 + 1 == wait_result)
-		curl_easy_pause(seg->http_handle_, CURLPAUSE_CONT);
-	LOG(("[ProgressCallback] tid=0x%x, dltotal=%lf, dlnow=%lf, ultotal=%lf, ulnow=%lf\n", 
-		GetCurrentThreadId(), dltotal, dlnow, ultotal, ulnow));
-	return 0;
-}
+	file_->NotifyTick();
+	file_->GetRateLimiter()->Tick();
 
-unsigned __stdcall  WebFileSegment::FileSegmentThread(void *arg)
-{
-	WebFileSegment *seg = (WebFileSegment*)arg;
+	if (flush_epoch_ != file_->flush_epoch_)
+	{
+		flush_epoch_ = file_->flush_epoch_;
+		file_->FlushBuffer(this);
+	}
 
-	if (WAIT_OBJECT_0 == WaitForSingleObject(seg->pause_event_, 0))
+	if (write_blocked_ && file_->HasFreeBuffer())
 	{
-		HANDLE event_handles[2];
-		event_handles[0] = seg->continue_event_;
-		event_handles[1] = seg->stop_event_;
-		DWORD wait_result = WaitForMultipleObjects(
-			_countof(event_handles), event_handles, FALSE, INFINITE);
+		write_blocked_ = false;
+		last_data_tick_ = GetTickCount();
+		curl_easy_pause(http_handle_, CURLPAUSE_CONT);
+	}
 
-		switch (wait_result)
+	if (!paused_)
+	{
+		if (throttled_ || write_blocked_ || WAIT_OBJECT_0 == WaitForSingleObject(pause_event_, 0))
+			last_data_tick_ = GetTickCount();
+		else if (GetTickCount() - last_data_tick_ >= SEGMENT_STALL_TIMEOUT)
 		{
-		case WAIT_OBJECT_0: // continue_event_
-			goto __download;
-		case WAIT_OBJECT_0 + 1: // stop_event_
-		default:
-			goto __end;
+			LOG(("[WebFileSegment::OnTick] Transfer stalled, offset=0x%llx\n", 
+				seg_offset_ + downloaded_size_));
+			return false;
 		}
+		return true;
 	}
 
-__download:
-	seg->http_handle_ = curl_easy_init();
-	if (!seg->http_handle_)
+	HANDLE event_handles[2];
+	event_handles[0] = continue_event_;
+	event_handles[1] = stop_event_;
+	DWORD wait_result = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, 0);
+	if (WAIT_OBJECT_0 == wait_result || WAIT_OBJECT_0 + 1 == wait_result)
 	{
-		seg->SetStatus(STATUS_INIT_FAILED);
-		goto __end;
+		paused_ = false;
+		last_data_tick_ = GetTickCount();
+		curl_easy_pause(http_handle_, CURLPAUSE_CONT);
 	}
+	return true;
+}
 
-	// Set HTTP options
-	curl_easy_setopt(seg->http_handle_, CURLOPT_URL, seg->url_.c_str());
-	curl_easy_setopt(seg->http_handle_, CURLOPT_WRITEFUNCTION, DownloadWriteDataCallback);
-	curl_easy_setopt(seg->http_handle_, CURLOPT_WRITEDATA, seg);
-	curl_easy_setopt(seg->http_handle_, CURLOPT_VERBOSE, 1);
-	curl_easy_setopt(seg->http_handle_, CURLOPT_DEBUGFUNCTION, DebugCallback);
-	curl_easy_setopt(seg->http_handle_, CURLOPT_DEBUGDATA, seg);
-	curl_easy_setopt(seg->http_handle_, CURLOPT_NOPROGRESS, 0);
-	curl_easy_setopt(seg->http_handle_, CURLOPT_PROGRESSFUNCTION, ProgressCallback);
-	curl_easy_setopt(seg->http_handle_, CURLOPT_PROGRESSDATA, seg);
-	SetProxyForHttpHandle(seg->http_handle_);
-
-	char *err_buffer = (char*)malloc(CURL_ERROR_SIZE);
-	if (err_buffer)
-		curl_easy_setopt(seg->http_handle_, CURLOPT_ERRORBUFFER, err_buffer);
-
-	// Set file position
-	CHAR range_header[1024];
-	ULONG64 range_start = seg->seg_offset_ + seg->downloaded_size_;
-	_snprintf(range_header, _countof(range_header), "Range: bytes=%lld-%lld", 
-		range_start, seg->seg_offset_ + seg->size_ - 1);
-	struct curl_slist *headers = NULL;
-	headers = curl_slist_append(headers, range_header);
-	if (!headers)
-	{
-		curl_easy_cleanup(seg->http_handle_);
-		seg->SetStatus(STATUS_INIT_FAILED);
-		goto __end;
-	}
-	curl_easy_setopt(seg->http_handle_, CURLOPT_HTTPHEADER, headers);
-
-	CURLcode download_result = curl_easy_perform(seg->http_handle_);
-	if (0 == download_result)
-		seg->SetStatus(STATUS_DOWNLOAD_FINISHED);
+void WebFileSegment::Resume()
+{
+	throttled_ = false;
+	last_data_tick_ = GetTickCount();
+	curl_easy_pause(http_handle_, CURLPAUSE_CONT);
+}
+
+void WebFileSegment::OnDone(CURLcode result)
+{
+	// Response without data (empty file) has not been checked by 
+	// DownloadWriteDataCallback(); its size is learnt here
+	if (!response_checked_ && response_code_)
+		response_checked_ = CheckResponse();
+
+	// Transfer of shrunk segment is aborted when the end of segment is reached.
+	// Mirror may close connection early; such range is restarted, as well 
+	// as the one which has not been written to disk.
+	if (0 == GetRemainingSize() && !write_error_)
+		SetStatus(STATUS_DOWNLOAD_FINISHED);
 	else
 	{
-		LOG(("Error: %s\n", err_buffer));
-		seg->SetStatus(STATUS_DOWNLOAD_FAILURE);
+		LOG(("Error: %s\n", err_buffer_ ? err_buffer_ : ""));
+		SetStatus(STATUS_DOWNLOAD_FAILURE);
+		// Signed target URL may have expired; retry follows the chain again
+		if (request_url_ != url_)
+			ForgetRedirectTarget(url_);
 	}
 
-	curl_slist_free_all(headers);
-	curl_easy_cleanup(seg->http_handle_);
-	if (err_buffer)
-		free(err_buffer);
+	// Segment may be deleted by WebFile below
+	file_->FlushBuffer(this);
+	file_->UnmapView(this);
+	Cleanup();
 
-__end:
-	_endthreadex(0);
-	return 0;
+	file_->NotifySegmentDone(this);
 }
-
@@ -5,8 +5,13 @@
 #include <boost/serialization/access.hpp>
 #include <boost/serialization/split_member.hpp>
 #include "curl/curl.h"
+#include "engine/transferengine.h"
+#include "engine/ratelimiter.h"
 
-class WebFileSegment
+// Size of the first segment until the file size is learnt from the response
+#define SEGMENT_SIZE_UNKNOWN ((unsigned long long)-1)
+
+class WebFileSegment : public Transfer, public RateLimited
 {
 public:
 	WebFileSegment(class WebFile *file,
@@ -25,29 +30,82 @@ public:
 
 	virtual ~WebFileSegment();
 
-	void Restart();
-
 	bool Start();
 
-	bool IsFinished();
+	bool IsActive() { return active_; }
 
 	bool Terminate();
 
+	/**
+	 *	Cut segment to the specified size. In-flight transfer is stopped
+	 *	as soon as the new end of segment is reached.
+	 *	Must be called from engine thread or for inactive segment.
+	 */
+	void Shrink(unsigned long long size);
+
 	std::string &GetUrl() { return url_; }
 
 	unsigned long long GetSegOffset() { return seg_offset_; }
 
+	unsigned long long GetSize() { return size_; }
+
+	bool IsSizeKnown() { return SEGMENT_SIZE_UNKNOWN != size_; }
+
+	unsigned long long GetDownloadedSize() { return AtomicRead64(&downloaded_size_); }
+
+	unsigned long long GetRemainingSize() { return size_ - GetDownloadedSize(); }
+
 	unsigned int GetStatus() { return download_status_; }
 
-	HANDLE GetThreadHandle() { return thread_; } 
+	/**
+	 *	Failed transfer is retried from the last written byte after a delay
+	 *	which grows exponentially with failures in a row (with random jitter).
+	 *	@return false if retry limit has been exceeded
+	 */
+	bool ScheduleRetry();
+
+	bool IsRetryDue();
+
+	/**
+	 *	Check status and size of the response before its data are accepted.
+	 *	The first segment of a file requests an open-ended range, and the 
+	 *	file size is taken from the response. Empty file is answered by 
+	 *	416 with zero total size in Content-Range, or by empty 200/206.
+	 *	Called from engine thread.
+	 */
+	bool CheckResponse();
+
+	/* Transfer interface (called from engine thread) */
+	virtual CURL *GetHttpHandle() { return http_handle_; }
+	virtual bool OnTick();
+	virtual void OnDone(CURLcode result);
+
+	/* RateLimited interface (called from engine thread) */
+	virtual void Resume();
 
 private:
-	std::string url_;
+	std::string url_;         // Mirror URL. Set by WebFile.
+	std::string request_url_; // Cached redirect target of url_, or url_ itself
 	unsigned long long seg_offset_;
 	unsigned long long size_;
 
-	size_t downloaded_size_;
-	size_t cached_downloaded_size_;
+	unsigned long long downloaded_size_; // Updated atomically by WebFile from engine thread
+	unsigned long long flushed_size_;    // Part of downloaded_size_ which is in the file; saved in state
+
+	// Write-behind buffer; accessed by WebFile from engine thread
+	BYTE *buffer_;                 // Taken from disk writer
+	size_t buffer_used_;
+	unsigned long long buffer_offset_;
+	size_t buffer_skew_;           // Data start here, at the same alignment as buffer_offset_ in the file
+	volatile LONG pending_writes_; // Buffers queued in disk writer
+	volatile LONG write_error_;    // Set by disk writer if a buffer is not written
+	LONG flush_epoch_;             // WebFile flush request which has been served
+	bool write_blocked_;           // Transfer has been paused: no free buffers
+
+	// View of WebFile mapping (WRITE_MODE_MAPPED); accessed by WebFile from engine thread
+	BYTE *view_;
+	unsigned long long view_offset_;
+	size_t view_size_;
 	unsigned int download_status_;
 
 
@@ -59,17 +117,45 @@ private:
 	HANDLE continue_event_;
 	HANDLE stop_event_;
 	class WebFile *file_;
-	HANDLE thread_;
-	void *http_handle_;
-
-	static unsigned __stdcall FileSegmentThread(void *arg);
+	CURL *http_handle_;
+	struct curl_slist *headers_;
+	char *err_buffer_;
+	bool active_; // Segment is attached to transfer engine. Cleared by WebFile under its lock.
+	bool paused_; // Transfer has been paused from DownloadWriteDataCallback
+	bool throttled_; // Transfer has been paused by rate limiter
+	std::string file_key_; // Rate limiter keys
+	std::string host_key_;
+	unsigned int mirror_;  // Index of WebFile mirror url_ belongs to. Set by WebFile.
+	DWORD last_data_tick_; // Time of the last data received; accessed from engine thread
+
+	// Retry state. Accessed by WebFile under its lock.
+	unsigned int retry_count_;        // Failures in a row
+	DWORD retry_start_;
+	DWORD retry_delay_;
+	unsigned long long attempt_size_; // downloaded_size_ when transfer was started
+	DWORD start_tick_;                // Time when transfer was started
+
+	// Response of the current transfer; accessed from engine thread
+	unsigned int response_code_;
+	unsigned long long total_size_;     // From Content-Range, SEGMENT_SIZE_UNKNOWN if not sent
+	unsigned long long content_length_; // SEGMENT_SIZE_UNKNOWN if not sent
+	bool response_checked_;
+
+	// Segment which downloads the same tail of the range (end-game mode).
+	// Both segments end at the same offset; the one which reaches it first wins.
+	// Accessed by WebFile under its lock.
+	WebFileSegment *peer_;
 
 	void SetStatus(unsigned int status);
 
+	void Cleanup();
+
+	friend class WebFile;
+
 	// CURL callbacks
 	static size_t DownloadWriteDataCallback(void *buffer, size_t size, size_t nmemb, void *userp);
+	static size_t HeaderCallback(void *buffer, size_t size, size_t nmemb, void *userp);
 	static int DebugCallback(CURL *handle, curl_infotype type, char *data, size_t size, void *userptr);
-	static int ProgressCallback(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow);
 
 	/* Serialization */
 	friend class boost::serialization::access;
@@ -80,7 +166,8 @@ private:
 		ar & download_status_;
 		ar & seg_offset_;
 		ar & size_;
-		ar & cached_downloaded_size_;
+		unsigned long long flushed_size = AtomicRead64(&flushed_size_);
+		ar & flushed_size;
 	}
 	template<class Archive>
 	void load(Archive & ar, const unsigned int version)
@@ -93,7 +180,7 @@ private:
 		ar & seg_offset_;
 		ar & size_;
 		ar & downloaded_size_;
-		cached_downloaded_size_ = downloaded_size_;
+		flushed_size_ = downloaded_size_;
 	}
 	BOOST_SERIALIZATION_SPLIT_MEMBER()
 
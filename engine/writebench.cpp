@@ -0,0 +1,229 @@
+/*
+ * Benchmark of output backends (WRITE_MODE_FILE and WRITE_MODE_MAPPED).
+ * Compile with -DWRITE_MODE_TEST to create a self-contained executable:
+ *
+ *     writebench <file name> <size in GB> [segment count]
+ *
+ * Data arrive in network-sized chunks to several segments at once, like
+ * in a multi-range download. WriteFile path collects them into write-behind
+ * buffers which are written at absolute offsets (as disk writer does);
+ * mapped path copies them to views of file mapping which move along with
+ * segment positions (as WebFile::WriteMapped() does). Throughput is printed
+ * for the writes themselves and including the flush to disk.
+ */
+
+#ifdef WRITE_MODE_TEST
+
+#include <windows.h>
+#include <tchar.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/consts.h"
+
+// Same as in webfile.cpp
+#define MAP_VIEW_SIZE      (8 * 1024 * 1024)
+#define MAP_VIEW_ALIGNMENT 0x10000
+
+// Size of data delivered by a cURL write callback
+#define CHUNK_SIZE (16 * 1024)
+
+#define MAX_SEGMENTS 64
+
+static BYTE chunk[CHUNK_SIZE];
+
+static HANDLE CreateOutput(const TCHAR *fname, unsigned long long file_size)
+{
+	HANDLE file_handle = CreateFile(fname, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, 0, NULL);
+	if (INVALID_HANDLE_VALUE == file_handle)
+		return file_handle;
+	// Both backends write to a preallocated file
+	LARGE_INTEGER size;
+	size.QuadPart = file_size;
+	if (!SetFilePointerEx(file_handle, size, NULL, FILE_BEGIN) || !SetEndOfFile(file_handle))
+	{
+		CloseHandle(file_handle);
+		return INVALID_HANDLE_VALUE;
+	}
+	return file_handle;
+}
+
+static void Report(const char *name, unsigned long long file_size, DWORD write_time, DWORD total_time)
+{
+	double mb = (double)file_size / (1024 * 1024);
+	printf("%-10s %8.1f MB/s written, %8.1f MB/s flushed\n", name,
+		mb * 1000 / max(write_time, 1UL), mb * 1000 / max(total_time, 1UL));
+}
+
+static bool BenchFile(const TCHAR *fname, unsigned long long file_size, unsigned int seg_count)
+{
+	HANDLE file_handle = CreateOutput(fname, file_size);
+	if (INVALID_HANDLE_VALUE == file_handle)
+		return false;
+
+	BYTE *buffers[MAX_SEGMENTS];
+	size_t buffer_used[MAX_SEGMENTS];
+	unsigned long long positions[MAX_SEGMENTS];
+	unsigned long long seg_size = file_size / seg_count;
+	for (unsigned int i = 0; i < seg_count; i++)
+	{
+		buffers[i] = (BYTE*)VirtualAlloc(NULL, DEFAULT_WRITE_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+		buffer_used[i] = 0;
+		positions[i] = i * seg_size;
+	}
+
+	bool ret_val = true;
+	DWORD start = GetTickCount();
+	for (unsigned long long done = 0; done < seg_size && ret_val; done += CHUNK_SIZE)
+	{
+		for (unsigned int i = 0; i < seg_count; i++)
+		{
+			memcpy(buffers[i] + buffer_used[i], chunk, CHUNK_SIZE);
+			buffer_used[i] += CHUNK_SIZE;
+			if (buffer_used[i] < DEFAULT_WRITE_BUFFER_SIZE && done + CHUNK_SIZE < seg_size)
+				continue;
+			OVERLAPPED overlapped;
+			memset(&overlapped, 0, sizeof(overlapped));
+			LARGE_INTEGER tmp;
+			tmp.QuadPart = positions[i];
+			overlapped.Offset = tmp.LowPart;
+			overlapped.OffsetHigh = tmp.HighPart;
+			DWORD nr_written;
+			if (!WriteFile(file_handle, buffers[i], (DWORD)buffer_used[i], &nr_written, &overlapped)
+				|| nr_written != buffer_used[i])
+			{
+				printf("WriteFile failed, error %u\n", GetLastError());
+				ret_val = false;
+				break;
+			}
+			positions[i] += buffer_used[i];
+			buffer_used[i] = 0;
+		}
+	}
+	DWORD write_time = GetTickCount() - start;
+	if (ret_val && !FlushFileBuffers(file_handle))
+	{
+		printf("FlushFileBuffers failed, error %u\n", GetLastError());
+		ret_val = false;
+	}
+	if (ret_val)
+		Report("WriteFile", seg_size * seg_count, write_time, GetTickCount() - start);
+
+	for (unsigned int i = 0; i < seg_count; i++)
+		VirtualFree(buffers[i], 0, MEM_RELEASE);
+	CloseHandle(file_handle);
+	return ret_val;
+}
+
+static bool BenchMapped(const TCHAR *fname, unsigned long long file_size, unsigned int seg_count)
+{
+	HANDLE file_handle = CreateOutput(fname, file_size);
+	if (INVALID_HANDLE_VALUE == file_handle)
+		return false;
+	LARGE_INTEGER size;
+	size.QuadPart = file_size;
+	HANDLE mapping_handle = CreateFileMapping(file_handle, NULL, PAGE_READWRITE,
+		size.HighPart, size.LowPart, NULL);
+	if (!mapping_handle)
+	{
+		CloseHandle(file_handle);
+		return false;
+	}
+
+	BYTE *views[MAX_SEGMENTS];
+	unsigned long long view_offsets[MAX_SEGMENTS];
+	size_t view_sizes[MAX_SEGMENTS];
+	unsigned long long positions[MAX_SEGMENTS];
+	unsigned long long seg_size = file_size / seg_count;
+	for (unsigned int i = 0; i < seg_count; i++)
+	{
+		views[i] = NULL;
+		view_offsets[i] = 0;
+		view_sizes[i] = 0;
+		positions[i] = i * seg_size;
+	}
+
+	bool ret_val = true;
+	DWORD start = GetTickCount();
+	for (unsigned long long done = 0; done < seg_size && ret_val; done += CHUNK_SIZE)
+	{
+		for (unsigned int i = 0; i < seg_count; i++)
+		{
+			size_t left = CHUNK_SIZE;
+			while (left)
+			{
+				unsigned long long offset = positions[i];
+				if (!views[i] || offset < view_offsets[i] || offset >= view_offsets[i] + view_sizes[i])
+				{
+					if (views[i])
+						UnmapViewOfFile(views[i]);
+					view_offsets[i] = offset & ~(unsigned long long)(MAP_VIEW_ALIGNMENT - 1);
+					view_sizes[i] = (size_t)min((unsigned long long)MAP_VIEW_SIZE, file_size - view_offsets[i]);
+					LARGE_INTEGER tmp;
+					tmp.QuadPart = view_offsets[i];
+					views[i] = (BYTE*)MapViewOfFile(mapping_handle, FILE_MAP_WRITE,
+						tmp.HighPart, tmp.LowPart, view_sizes[i]);
+					if (!views[i])
+					{
+						printf("MapViewOfFile failed, error %u\n", GetLastError());
+						ret_val = false;
+						break;
+					}
+				}
+				size_t size = (size_t)min((unsigned long long)left, view_offsets[i] + view_sizes[i] - offset);
+				memcpy(views[i] + (size_t)(offset - view_offsets[i]), chunk, size);
+				positions[i] += size;
+				left -= size;
+			}
+			if (!ret_val)
+				break;
+		}
+	}
+	DWORD write_time = GetTickCount() - start;
+	for (unsigned int i = 0; i < seg_count; i++)
+	{
+		if (views[i])
+		{
+			FlushViewOfFile(views[i], 0);
+			UnmapViewOfFile(views[i]);
+		}
+	}
+	FlushFileBuffers(file_handle);
+	if (ret_val)
+		Report("Mapped", seg_size * seg_count, write_time, GetTickCount() - start);
+
+	CloseHandle(mapping_handle);
+	CloseHandle(file_handle);
+	return ret_val;
+}
+
+int _tmain(int argc, TCHAR *argv[])
+{
+	if (argc < 3)
+	{
+		printf("Usage: writebench <file name> <size in GB> [segment count]\n");
+		return 1;
+	}
+	unsigned long long file_size = _tcstoui64(argv[2], NULL, 10) * 1024 * 1024 * 1024;
+	unsigned int seg_count = (argc > 3) ? _tcstoul(argv[3], NULL, 10) : 8;
+	if (0 == file_size || 0 == seg_count || seg_count > MAX_SEGMENTS)
+	{
+		printf("Invalid parameters\n");
+		return 1;
+	}
+	// Segments get whole chunks
+	file_size -= file_size % ((unsigned long long)seg_count * CHUNK_SIZE);
+	for (size_t i = 0; i < sizeof(chunk); i++)
+		chunk[i] = (BYTE)rand();
+
+	bool ret_val = BenchFile(argv[1], file_size, seg_count)
+		&& BenchMapped(argv[1], file_size, seg_count);
+	DeleteFile(argv[1]);
+	if (!ret_val)
+		printf("Benchmark failed, error %u\n", GetLastError());
+	return ret_val ? 0 : 1;
+}
+
+#endif  /* WRITE_MODE_TEST */